@@ -0,0 +1,116 @@
+#include "Alloc.h"
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+AllocPool& AllocPool::instance() {
+    // Never destroyed, so that buffers freed during static destruction can still be returned
+    static AllocPool *pool = new AllocPool();
+    return *pool;
+}
+
+size_t AllocPool::mapped_length(size_t size) {
+    if (size >= HUGE_PAGE_SIZE) {
+        return RoundUp(size, HUGE_PAGE_SIZE);
+    }
+    return RoundUp(size, Alloc::PAGE_SIZE);
+}
+
+void* AllocPool::map(size_t length, bool prefault) {
+    char *addr;
+    if (length >= HUGE_PAGE_SIZE) {
+        // Map an extra huge page so that the buffer can start on a huge page boundary, and trim the ends
+        char *mapping = (char*) mmap64(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        addr = (char*) RoundUp((size_t) mapping, HUGE_PAGE_SIZE);
+        if (addr > mapping) {
+            munmap(mapping, addr - mapping);
+        }
+        if (mapping + HUGE_PAGE_SIZE > addr) {
+            munmap(addr + length, mapping + HUGE_PAGE_SIZE - addr);
+        }
+        // Transparent huge pages are only a hint. Without them the buffer is backed by regular pages
+        madvise(addr, length, MADV_HUGEPAGE);
+    } else {
+        addr = (char*) mmap64(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+    if (prefault && madvise(addr, length, MADV_POPULATE_WRITE) != 0) {
+        // Kernels before 5.14 cannot populate a range in one call. Touch every page instead
+        for (size_t offset = 0; offset < length; offset += Alloc::PAGE_SIZE) {
+            ((volatile char*) addr)[offset] = 0;
+        }
+    }
+    return addr;
+}
+
+void* AllocPool::acquire(size_t length, bool prefault) {
+    AllocPool &pool = instance();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        auto it = pool.free_buffers.find(length);
+        if (it != pool.free_buffers.end() && !it->second.empty()) {
+            // A recycled buffer has been faulted in already
+            void *addr = it->second.back();
+            it->second.pop_back();
+            pool.cached_bytes -= length;
+            pool.hits++;
+            return addr;
+        }
+        pool.misses++;
+    }
+    return map(length, prefault);
+}
+
+void AllocPool::release(void *addr, size_t length, bool remapped) {
+    AllocPool &pool = instance();
+    if (!remapped) {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.cached_bytes + length <= pool.capacity) {
+            pool.free_buffers[length].push_back(addr);
+            pool.cached_bytes += length;
+            return;
+        }
+    }
+    munmap(addr, length);
+}
+
+void AllocPool::change_capacity(ssize_t delta) {
+    AllocPool &pool = instance();
+    std::vector<std::pair<void*, size_t>> trimmed;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.capacity += delta;
+        for (auto it = pool.free_buffers.begin(); pool.cached_bytes > pool.capacity && it != pool.free_buffers.end();
+             it++) {
+            while (pool.cached_bytes > pool.capacity && !it->second.empty()) {
+                trimmed.emplace_back(it->second.back(), it->first);
+                it->second.pop_back();
+                pool.cached_bytes -= it->first;
+            }
+        }
+    }
+    // Unmapping can take a while, so it is done without the lock
+    for (auto &buffer: trimmed) {
+        munmap(buffer.first, buffer.second);
+    }
+}
+
+void* AllocPool::remap(void *addr, size_t length, size_t new_length) {
+    void *new_addr = mremap(addr, length, new_length, MREMAP_MAYMOVE);
+    return (new_addr == MAP_FAILED)? nullptr: new_addr;
+}
+
+std::string AllocPool::to_string() {
+    AllocPool &pool = instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return std::to_string(pool.hits) + " buffers recycled, " + std::to_string(pool.misses) + " mapped, "
+        + std::to_string(pool.cached_bytes) + " of " + std::to_string(pool.capacity) + " bytes cached";
+}
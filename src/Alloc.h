@@ -1,12 +1,66 @@
 #pragma once
 #include "defs.h"
+#include "Record.h"
 #include <iostream>
 #include <cstdint>
 #include <memory>
 #include <unistd.h>
 #include <cstring>
 #include <emmintrin.h>
-#include <sys/mman.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Process-wide cache of mapped buffers. Freed buffers are kept by their mapped length and handed out again to the
+ * next allocation of the same length, so that a run of the same size as the last one costs no system call and no
+ * page faults. Buffers of at least a huge page are aligned to huge pages and backed by transparent huge pages. The
+ * cache lives on memory that the memory brokers have not granted: its capacity is set by the brokers, which shrink it
+ * as they grant more (see MemoryBroker)
+ */
+class AllocPool {
+public:
+    // Buffer of `length` bytes, which must be a multiple of the page size. If `prefault` is set, the pages of a new
+    // mapping are faulted in up front. Returns nullptr if the memory could not be mapped
+    static void* acquire(size_t length, bool prefault);
+
+    // Return a buffer to the cache. Buffers that were remapped are unmapped instead, as they may have lost the
+    // alignment and the faulted-in pages of a fresh mapping
+    static void release(void *addr, size_t length, bool remapped = false);
+
+    // Change the most bytes of free buffers kept mapped by `delta`. Cached buffers beyond the new capacity are
+    // unmapped
+    static void change_capacity(ssize_t delta);
+
+    // Length of the mapping that holds `size` bytes
+    static size_t mapped_length(size_t size);
+
+    // Move a buffer to a mapping of a new length, keeping the contents that fit. Returns nullptr on failure
+    static void* remap(void *addr, size_t length, size_t new_length);
+
+    // Allocations served from the cache and by new mappings
+    static std::string to_string();
+
+    static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+private:
+    std::mutex mutex;
+
+    std::unordered_map<size_t, std::vector<void*>> free_buffers;
+
+    size_t cached_bytes {0};
+
+    size_t capacity {0};
+
+    size_t hits {0};
+
+    size_t misses {0};
+
+    static AllocPool& instance();
+
+    static void* map(size_t length, bool prefault);
+};
 
 /**
  * Class to represent a cache-sized run in memory
@@ -17,21 +71,37 @@ public:
         write_offset = 0;
     }
 
-    static std::shared_ptr<Alloc> create(size_t size=PAGE_SIZE) {
+    /**
+     * Allocate a buffer of at least `size` bytes from the pool. If `prefault` is set and the buffer is newly mapped,
+     * its pages are faulted in before returning, for buffers that are about to be written from start to end
+     */
+    static std::shared_ptr<Alloc> create(size_t size=PAGE_SIZE, bool prefault=false) {
         // make size a multiple of 64 bytes to avoid cache line split
         size += (CACHE_LINE_SIZE - size%CACHE_LINE_SIZE);
         auto alloc_ptr = std::make_shared<Alloc>();
         alloc_ptr->capacity = size;
-        // Use mmap so that each memory allocation is done on a fresh page
-        alloc_ptr->start_addr = mmap64(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (alloc_ptr->start_addr == MAP_FAILED) {
+        alloc_ptr->mapped_length = AllocPool::mapped_length(size);
+        alloc_ptr->start_addr = AllocPool::acquire(alloc_ptr->mapped_length, prefault);
+        if (alloc_ptr->start_addr == nullptr) {
             return nullptr;
         }
         return alloc_ptr;
     }
 
+    // Bytes of memory mapped for a buffer created with `size` bytes
+    static size_t get_mapped_size(size_t size) {
+        return AllocPool::mapped_length(size + (CACHE_LINE_SIZE - size%CACHE_LINE_SIZE));
+    }
+
     ~Alloc() {
-        munmap(start_addr, capacity);
+        if (start_addr != nullptr) {
+            AllocPool::release(start_addr, mapped_length, remapped);
+        }
+    }
+
+    // Discard the contents so the buffer can be refilled
+    inline void clear() {
+        write_offset = 0;
     }
 
     inline void prepare_for_read() {
@@ -39,18 +109,68 @@ public:
         read_offset = 0ll;
     }
 
-    inline Row* read_record(size_t offset) {
-        return reinterpret_cast<Row*>(start_addr + offset);
+    template<typename RowType = Row>
+    inline RowType* read_record(size_t offset) {
+        return reinterpret_cast<RowType*>(start_addr + offset);
     }
 
-    // Explicitly flush the cache lines to memory
+    // Explicitly flush the cache lines that have been written to memory
     inline void flush() {
-        void *cur_ptr = start_addr;
-        for (size_t offset = 0; offset < capacity; offset += CACHE_LINE_SIZE) {
+        for (size_t offset = 0; offset < write_offset; offset += CACHE_LINE_SIZE) {
             _mm_clflush((char *)start_addr + offset);
         }
     }
 
+    /**
+     * Append with non-temporal stores, which go to memory through the write-combining buffers without reading the
+     * cache lines in or evicting anything from the cache. Bytes are staged until a whole cache line can be stored.
+     * The run must only be written this way, and finish_streaming() must be called before it is read
+     */
+    inline void write_streaming(const void *ptr, size_t bytes) {
+        const char *src = static_cast<const char*>(ptr);
+        while (bytes > 0) {
+            size_t line_offset = write_offset % CACHE_LINE_SIZE;
+            size_t chunk = min(bytes, CACHE_LINE_SIZE - line_offset);
+            memcpy(staging + line_offset, src, chunk);
+            write_offset += chunk;
+            src += chunk;
+            bytes -= chunk;
+            if (line_offset + chunk == CACHE_LINE_SIZE) {
+                __m128i *line = reinterpret_cast<__m128i*>((char *)start_addr + write_offset - CACHE_LINE_SIZE);
+                const __m128i *staged = reinterpret_cast<const __m128i*>(staging);
+                _mm_stream_si128(line, _mm_loadu_si128(staged));
+                _mm_stream_si128(line + 1, _mm_loadu_si128(staged + 1));
+                _mm_stream_si128(line + 2, _mm_loadu_si128(staged + 2));
+                _mm_stream_si128(line + 3, _mm_loadu_si128(staged + 3));
+            }
+        }
+    }
+
+    // Store the partial last line and order the non-temporal stores before the reads that follow
+    inline void finish_streaming() {
+        size_t line_offset = write_offset % CACHE_LINE_SIZE;
+        memcpy((char *)start_addr + write_offset - line_offset, staging, line_offset);
+        _mm_sfence();
+    }
+
+    // Change the capacity to at least `size` bytes, keeping the contents that fit. The run may move, so pointers into
+    // it are invalidated. Returns false if the memory could not be mapped
+    inline bool resize(size_t size) {
+        size += (CACHE_LINE_SIZE - size%CACHE_LINE_SIZE);
+        size_t new_length = AllocPool::mapped_length(size);
+        if (new_length != mapped_length) {
+            void *new_addr = AllocPool::remap(start_addr, mapped_length, new_length);
+            if (new_addr == nullptr) {
+                return false;
+            }
+            start_addr = new_addr;
+            mapped_length = new_length;
+            remapped = true;
+        }
+        capacity = size;
+        return true;
+    }
+
     inline bool can_write(size_t bytes) {
         return (capacity - write_offset >= bytes);
     }
@@ -64,6 +184,15 @@ public:
         return write_offset;
     }
 
+    // Mark the first `bytes` bytes as valid after they were filled in directly (e.g. by a file read)
+    inline void set_size(size_t bytes) {
+        write_offset = bytes;
+    }
+
+    inline void* get_addr() {
+        return start_addr;
+    }
+
     inline size_t get_capacity() {
         return capacity;
     }
@@ -80,4 +209,13 @@ private:
     size_t read_offset;
 
     size_t capacity;
+
+    // Length of the mapping, which is the capacity rounded up to whole pages
+    size_t mapped_length;
+
+    // Set once the buffer has been moved by resize()
+    bool remapped {false};
+
+    // Cache line being filled by write_streaming()
+    char staging[CACHE_LINE_SIZE];
 };
\ No newline at end of file
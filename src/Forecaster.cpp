@@ -0,0 +1,4 @@
+#include "Forecaster.h"
+#include "Sorter.h"
+
+template class BasicForecaster<SortSchema>;
@@ -0,0 +1,133 @@
+#pragma once
+#include "defs.h"
+#include "Alloc.h"
+#include "SpillFile.h"
+#include <memory>
+#include <vector>
+
+template<typename RowSchema>
+class BasicReaderNode;
+
+/**
+ * Class implementing forecasting for a merge of spilled runs. Each run keeps a single block in memory. The run whose
+ * current block ends with the smallest key is the next one to run out of rows, so the next block of that run is read
+ * ahead into a single buffer that is shared by all the inputs of the merge
+ */
+template<typename RowSchema>
+class BasicForecaster {
+    typedef BasicRow<RowSchema> RowType;
+
+    typedef BasicReaderNode<RowSchema> ReaderNode;
+
+public:
+    // All the inputs must read blocks of `block_size` bytes, rounded down to whole rows, since their buffers are
+    // exchanged with the prefetch buffer
+    BasicForecaster(size_t block_size = SpillFile::BLOCK_SIZE):
+            block_size(RoundDown(block_size, sizeof(RowType))) {}
+
+    ~BasicForecaster() {
+        if (prefetch_request != nullptr) {
+            // Don't release the buffer while the kernel may still write into it
+            prefetch_file->finish_read(prefetch_request, *prefetch_buffer);
+        }
+    }
+
+    void add_input(ReaderNode *reader) {
+        readers.push_back(reader);
+    }
+
+    // Read the first block of every input and start the first forecast read
+    void start() {
+        if (readers.empty()) {
+            // No input is read from disk
+            return;
+        }
+        prefetch_buffer = Alloc::create(block_size);
+        std::vector<std::shared_ptr<IORequest>> requests;
+        for (auto reader: readers) {
+            requests.push_back(reader->input_file->start_read(0ll, *reader->input, block_size));
+        }
+        for (size_t i=0; i<readers.size(); i++) {
+            readers[i]->input_file->finish_read(requests[i], *readers[i]->input);
+            readers[i]->block_offset = 0ll;
+        }
+        forecast();
+    }
+
+    // Load the next block of a run whose current block is exhausted
+    void refill(ReaderNode &reader) {
+        size_t offset = reader.read_offset;
+        if (prefetch_reader == &reader && prefetch_offset == offset) {
+            // Forecast was correct. The prefetched block becomes the current block of the input and its old block
+            // becomes the shared prefetch buffer
+            prefetch_file->finish_read(prefetch_request, *prefetch_buffer);
+            std::swap(reader.input, prefetch_buffer);
+            prefetch_request = nullptr;
+            prefetch_reader = nullptr;
+            prefetch_file = nullptr;
+        } else {
+            // Another input ran out first (its last key ties with the forecast input). Read synchronously
+            reader.input_file->read_block(offset, *reader.input, block_size);
+        }
+        reader.block_offset = offset;
+        forecast();
+    }
+
+    inline size_t get_block_size() {
+        return block_size;
+    }
+
+    // Bytes of memory of each buffer of a forecaster created with `block_size`
+    static size_t get_buffer_memory(size_t block_size) {
+        return Alloc::get_mapped_size(RoundDown(block_size, sizeof(RowType)));
+    }
+
+private:
+    std::vector<ReaderNode*> readers;
+
+    size_t block_size;
+
+    std::shared_ptr<Alloc> prefetch_buffer;
+
+    std::shared_ptr<IORequest> prefetch_request {nullptr};
+
+    // Input that the prefetch buffer is being filled for
+    ReaderNode *prefetch_reader {nullptr};
+
+    std::shared_ptr<SpillFile> prefetch_file {nullptr};
+
+    size_t prefetch_offset;
+
+    // Start reading the next block of the input that will run out first
+    void forecast() {
+        if (prefetch_request != nullptr) {
+            return;
+        }
+        ReaderNode *next_reader = nullptr;
+        RowType *next_last_row = nullptr;
+        for (auto reader: readers) {
+            size_t block_size = reader->input->get_size();
+            if (reader->block_offset + block_size >= reader->size) {
+                // The last block of this run is already in memory
+                continue;
+            }
+            RowType *last_row = reader->input->template read_record<RowType>(block_size - sizeof(RowType));
+            if (next_reader == nullptr || last_row->key_less(*next_last_row)) {
+                next_reader = reader;
+                next_last_row = last_row;
+            }
+        }
+        if (next_reader == nullptr) {
+            return;
+        }
+        prefetch_reader = next_reader;
+        prefetch_file = next_reader->input_file;
+        prefetch_offset = next_reader->block_offset + next_reader->input->get_size();
+        prefetch_request = prefetch_file->start_read(prefetch_offset, *prefetch_buffer, block_size);
+    }
+};
+
+typedef BasicForecaster<SortSchema> Forecaster;
+
+// Instantiated in Forecaster.cpp
+extern template class BasicForecaster<SortSchema>;
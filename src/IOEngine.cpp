@@ -0,0 +1,324 @@
+#include "IOEngine.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Perform (the rest of) a request synchronously
+static void perform_request(IORequest &request) {
+    while (request.done_bytes < request.bytes) {
+        char *buffer = request.buffer + request.done_bytes;
+        size_t remaining = request.bytes - request.done_bytes;
+        off_t offset = request.offset + request.done_bytes;
+        ssize_t res = request.is_write? pwrite(request.fd, buffer, remaining, offset)
+                                      : pread(request.fd, buffer, remaining, offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            request.error = (res < 0)? errno: EIO;
+            return;
+        }
+        request.done_bytes += res;
+    }
+}
+
+/**
+ * Fallback engine: a small pool of threads doing blocking pread/pwrite
+ */
+class ThreadPoolEngine : public IOEngine {
+public:
+    ThreadPoolEngine(): pool(NUM_THREADS) {}
+
+    void submit(const std::shared_ptr<IORequest> &request) override {
+        pool.submit([this, request] {
+            perform_request(*request);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                request->completed = true;
+            }
+            request_completed.notify_all();
+        });
+    }
+
+    void wait(const std::shared_ptr<IORequest> &request) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        request_completed.wait(lock, [&request] { return request->completed; });
+    }
+
+    char const * name() override {
+        return "threads";
+    }
+
+private:
+    static const size_t NUM_THREADS = 4;
+
+    std::mutex mutex;
+
+    std::condition_variable request_completed;
+
+    // Declared last so that the workers are joined before the mutex is destroyed
+    ThreadPool pool;
+};
+
+#ifdef HAVE_IO_URING
+/**
+ * Engine submitting readv/writev requests to an io_uring. The rings are accessed under a single mutex, which is not
+ * held while a thread blocks in the kernel for completions, so that other threads can submit and reap in the meantime
+ */
+class UringEngine : public IOEngine {
+public:
+    ~UringEngine() {
+        if (ring_fd < 0) {
+            return;
+        }
+        munmap(sqes, sqes_size);
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+    }
+
+    // Returns nullptr if io_uring is not available
+    static std::shared_ptr<UringEngine> create() {
+        auto engine = std::make_shared<UringEngine>();
+        if (!engine->setup()) {
+            return nullptr;
+        }
+        return engine;
+    }
+
+    void submit(const std::shared_ptr<IORequest> &request) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (in_flight == num_entries) {
+            // Submission queue is full. Make room by waiting for a completion
+            wait_for_completions(lock);
+        }
+        push_sqe(request.get());
+        // Hold a reference until the request completes
+        pending.push_back(request);
+    }
+
+    void wait(const std::shared_ptr<IORequest> &request) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!reaping) {
+            reap();
+        }
+        while (!request->completed) {
+            wait_for_completions(lock);
+        }
+    }
+
+    char const * name() override {
+        return "io_uring";
+    }
+
+private:
+    static const unsigned NUM_ENTRIES = 256;
+
+    int ring_fd {-1};
+
+    unsigned num_entries;
+
+    void *sq_ring {nullptr};
+
+    void *cq_ring {nullptr};
+
+    size_t sq_ring_size;
+
+    size_t cq_ring_size;
+
+    struct io_uring_sqe *sqes {nullptr};
+
+    size_t sqes_size;
+
+    unsigned *sq_tail;
+
+    unsigned *sq_mask;
+
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+
+    unsigned *cq_tail;
+
+    unsigned *cq_mask;
+
+    struct io_uring_cqe *cqes;
+
+    unsigned in_flight {0};
+
+    std::vector<std::shared_ptr<IORequest>> pending;
+
+    std::mutex mutex;
+
+    // Set while a thread waits in the kernel for completions. Only that thread reaps them in the meantime, so that the
+    // completions it waits for are not taken from under it
+    bool reaping {false};
+
+    // Notified when the completions have been reaped
+    std::condition_variable reaped;
+
+    bool setup() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, NUM_ENTRIES, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+        num_entries = params.sq_entries;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = (sq_ring_size > cq_ring_size)? sq_ring_size: cq_ring_size;
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+        cq_ring = single_mmap? sq_ring: mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            munmap(sq_ring, sq_ring_size);
+            close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+        char *sq_base = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+        char *cq_base = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq_base + params.cq_off.cqes);
+        return true;
+    }
+
+    // Queue the remaining part of a request and submit it to the kernel
+    void push_sqe(IORequest *request) {
+        request->iov.iov_base = request->buffer + request->done_bytes;
+        request->iov.iov_len = request->bytes - request->done_bytes;
+
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->is_write? IORING_OP_WRITEV: IORING_OP_READV;
+        sqe->fd = request->fd;
+        sqe->off = request->offset + request->done_bytes;
+        sqe->addr = reinterpret_cast<uint64_t>(&request->iov);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uint64_t>(request);
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        in_flight++;
+
+        while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0) {
+            FinalAssert (errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        }
+    }
+
+    /**
+     * Wait for at least one request to complete and reap the completions. Called with the lock held. A single thread
+     * blocks in the kernel, without the lock, and the other threads wait until it has reaped
+     */
+    void wait_for_completions(std::unique_lock<std::mutex> &lock) {
+        if (reaping) {
+            reaped.wait(lock);
+            return;
+        }
+        reaping = true;
+        lock.unlock();
+        while (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+            FinalAssert (errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        }
+        lock.lock();
+        reaping = false;
+        reap();
+        reaped.notify_all();
+    }
+
+    // Process all available completions. Called with the lock held
+    void reap() {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        bool any_completed = false;
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            IORequest *request = reinterpret_cast<IORequest*>(cqe->user_data);
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            in_flight--;
+
+            if (res == -EINTR || res == -EAGAIN) {
+                push_sqe(request);
+                continue;
+            }
+            if (res <= 0) {
+                request->error = (res < 0)? -res: EIO;
+            } else {
+                request->done_bytes += res;
+                if (request->done_bytes < request->bytes) {
+                    // Short transfer. Submit the remainder
+                    push_sqe(request);
+                    continue;
+                }
+            }
+            request->completed = true;
+            any_completed = true;
+        }
+        if (any_completed) {
+            for (size_t i=0; i<pending.size();) {
+                if (pending[i]->completed) {
+                    pending[i] = std::move(pending.back());
+                    pending.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+    }
+};
+#endif
+
+std::shared_ptr<IOEngine> IOEngine::get_default() {
+    static std::shared_ptr<IOEngine> engine = [] () -> std::shared_ptr<IOEngine> {
+        char const * const requested = getenv("SORT_IO_ENGINE");
+        bool use_threads = (requested != nullptr && strcmp(requested, "threads") == 0);
+#ifdef HAVE_IO_URING
+        if (!use_threads) {
+            auto uring_engine = UringEngine::create();
+            if (uring_engine != nullptr) {
+                return uring_engine;
+            }
+        }
+#endif
+        (void) use_threads;
+        return std::make_shared<ThreadPoolEngine>();
+    } ();
+    return engine;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "defs.h"
+#include <sys/uio.h>
+#include <memory>
+
+/**
+ * Struct representing a single read or write of a contiguous buffer at a file offset
+ */
+struct IORequest {
+    int fd;
+
+    char *buffer;
+
+    size_t bytes;
+
+    size_t offset;
+
+    bool is_write;
+
+    // Number of bytes transferred so far. Short transfers are resubmitted for the remainder
+    size_t done_bytes {0};
+
+    int error {0};
+
+    bool completed {false};
+
+    // Used by the io_uring engine, which needs a stable iovec until the request completes
+    struct iovec iov;
+
+    IORequest(int fd, void *buffer, size_t bytes, size_t offset, bool is_write)
+        : fd(fd), buffer(static_cast<char*>(buffer)), bytes(bytes), offset(offset), is_write(is_write) {}
+};
+
+/**
+ * Base class for an engine that performs file I/O asynchronously, so that merging can overlap with disk transfers.
+ * The buffer of a request must stay valid until wait() has returned for it
+ */
+class IOEngine {
+public:
+    virtual ~IOEngine() = default;
+
+    virtual void submit(const std::shared_ptr<IORequest> &request) = 0;
+
+    // Block until the request has completed
+    virtual void wait(const std::shared_ptr<IORequest> &request) = 0;
+
+    virtual char const * name() = 0;
+
+    /**
+     * Returns the process-wide engine. io_uring is used when the kernel supports it, otherwise a pool of threads
+     * doing pread/pwrite. Setting the environment variable SORT_IO_ENGINE=threads forces the thread pool
+     */
+    static std::shared_ptr<IOEngine> get_default();
+
+    std::shared_ptr<IORequest> read(int fd, void *buffer, size_t bytes, size_t offset) {
+        auto request = std::make_shared<IORequest>(fd, buffer, bytes, offset, false);
+        submit(request);
+        return request;
+    }
+
+    std::shared_ptr<IORequest> write(int fd, const void *buffer, size_t bytes, size_t offset) {
+        auto request = std::make_shared<IORequest>(fd, const_cast<void*>(buffer), bytes, offset, true);
+        submit(request);
+        return request;
+    }
+};
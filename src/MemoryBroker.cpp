@@ -0,0 +1,165 @@
+#include "MemoryBroker.h"
+#include "defs.h"
+#include "Alloc.h"
+#include <algorithm>
+#include <unistd.h>
+
+MemoryGrant::MemoryGrant(MemoryBroker &broker, size_t minimum, size_t maximum, int priority,
+                         std::function<void(size_t)> on_resize)
+    : broker(broker), minimum(minimum), maximum(maximum), size(minimum), priority(priority),
+      on_resize(std::move(on_resize)) {}
+
+MemoryGrant::~MemoryGrant() {
+    broker.release(this);
+}
+
+size_t MemoryGrant::get_size() {
+    std::lock_guard<std::mutex> lock(broker.mutex);
+    return size;
+}
+
+size_t MemoryGrant::request(size_t bytes) {
+    std::lock_guard<std::mutex> lock(broker.mutex);
+    bytes = min(bytes, maximum);
+    if (bytes <= size) {
+        return size;
+    }
+    size_t wanted = bytes - size;
+    size_t free = broker.pool_size - broker.granted;
+    if (free < wanted) {
+        broker.reclaim(wanted - free, priority, false, this);
+        free = broker.pool_size - broker.granted;
+    }
+    size_t grown = min(wanted, free);
+    if (grown > 0) {
+        size += grown;
+        broker.granted += grown;
+        broker.peak_granted = max(broker.peak_granted, broker.granted);
+        broker.update_cache_capacity();
+        on_resize(size);
+    }
+    return size;
+}
+
+void MemoryGrant::set_maximum(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(broker.mutex);
+        maximum = bytes;
+        minimum = min(minimum, maximum);
+        if (size < maximum) {
+            size_t grown = min(maximum - size, broker.pool_size - broker.granted);
+            if (grown > 0) {
+                size += grown;
+                broker.granted += grown;
+                broker.peak_granted = max(broker.peak_granted, broker.granted);
+                broker.update_cache_capacity();
+                on_resize(size);
+            }
+            return;
+        }
+        if (size == maximum) {
+            return;
+        }
+        broker.granted -= size - maximum;
+        size = maximum;
+        broker.update_cache_capacity();
+        on_resize(size);
+    }
+    broker.released.notify_all();
+}
+
+MemoryBroker::MemoryBroker(size_t pool_size): pool_size(pool_size) {}
+
+MemoryBroker::~MemoryBroker() {
+    AllocPool::change_capacity(-(ssize_t) cache_capacity);
+}
+
+MemoryBroker& MemoryBroker::global() {
+    static MemoryBroker broker = [] {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        return MemoryBroker {(pages > 0 && page_size > 0)? (size_t) pages * page_size / 4: 1ull << 30};
+    } ();
+    return broker;
+}
+
+std::unique_ptr<MemoryGrant> MemoryBroker::admit(size_t minimum, size_t maximum, int priority,
+                                                 std::function<void(size_t)> on_resize) {
+    // A sort that asks for more than the whole pool is admitted with the pool
+    minimum = min(minimum, pool_size);
+    maximum = max(maximum, minimum);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (pool_size - granted < minimum) {
+        reclaim(minimum - (pool_size - granted), priority, true, nullptr);
+    }
+    if (pool_size - granted < minimum) {
+        num_waited++;
+        released.wait(lock, [&] {
+            if (pool_size - granted < minimum) {
+                reclaim(minimum - (pool_size - granted), priority, true, nullptr);
+            }
+            return pool_size - granted >= minimum;
+        });
+    }
+    std::unique_ptr<MemoryGrant> grant {new MemoryGrant(*this, minimum, maximum, priority, std::move(on_resize))};
+    grants.push_back(grant.get());
+    granted += minimum;
+    peak_granted = max(peak_granted, granted);
+    num_admitted++;
+    update_cache_capacity();
+    return grant;
+}
+
+void MemoryBroker::reclaim(size_t bytes, int priority, bool include_equal, const MemoryGrant *requester) {
+    std::vector<MemoryGrant*> victims;
+    for (auto grant: grants) {
+        if (grant != requester && grant->size > grant->minimum
+                && (grant->priority < priority || (include_equal && grant->priority == priority))) {
+            victims.push_back(grant);
+        }
+    }
+    std::sort(victims.begin(), victims.end(), [](MemoryGrant *a, MemoryGrant *b) {
+        return a->priority < b->priority;
+    });
+    for (auto grant: victims) {
+        if (bytes == 0) {
+            break;
+        }
+        size_t taken = min(bytes, grant->size - grant->minimum);
+        grant->size -= taken;
+        granted -= taken;
+        reclaimed_bytes += taken;
+        bytes -= taken;
+        grant->on_resize(grant->size);
+    }
+}
+
+void MemoryBroker::update_cache_capacity() {
+    size_t capacity = min(granted / CACHE_FRACTION, pool_size - granted);
+    AllocPool::change_capacity((ssize_t) capacity - (ssize_t) cache_capacity);
+    cache_capacity = capacity;
+}
+
+void MemoryBroker::release(MemoryGrant *grant) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        granted -= grant->size;
+        grants.erase(std::find(grants.begin(), grants.end(), grant));
+        update_cache_capacity();
+    }
+    released.notify_all();
+}
+
+double MemoryBroker::get_utilization() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (double) granted / pool_size;
+}
+
+std::string MemoryBroker::to_string() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return "pool " + std::to_string(pool_size) + " bytes, " + std::to_string(granted) + " granted ("
+        + std::to_string(100.0 * granted / pool_size) + "%) to " + std::to_string(grants.size())
+        + " sorts, peak " + std::to_string(peak_granted) + " (" + std::to_string(100.0 * peak_granted / pool_size)
+        + "%), " + std::to_string(num_admitted) + " sorts admitted, " + std::to_string(num_waited)
+        + " waited, " + std::to_string(reclaimed_bytes) + " bytes reclaimed";
+}
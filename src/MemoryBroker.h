@@ -0,0 +1,125 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class MemoryBroker;
+
+/**
+ * Memory granted to a single sort by the broker. The grant lies between the minimum the sort was admitted with and the
+ * maximum it asked for. It grows when the sort asks for more, and it may shrink below what the sort holds when memory
+ * is taken back for a sort with a higher priority. Every change is passed to the sort through its resize callback,
+ * and the sort brings its memory in line with the grant at its next chance. The memory is returned on destruction
+ */
+class MemoryGrant {
+public:
+    ~MemoryGrant();
+
+    size_t get_size();
+
+    /**
+     * Ask for the grant to grow to `bytes`, no further than the maximum. Free memory of the pool is handed out first,
+     * then memory is taken back from sorts with a lower priority. Never blocks. Returns the new size of the grant
+     */
+    size_t request(size_t bytes);
+
+    /**
+     * Change the most that the sort may use. A larger grant is shrunk and the difference returned to the pool. A
+     * smaller grant grows towards the new maximum with the free memory of the pool, without taking memory back from
+     * other sorts
+     */
+    void set_maximum(size_t bytes);
+
+private:
+    friend class MemoryBroker;
+
+    MemoryGrant(MemoryBroker &broker, size_t minimum, size_t maximum, int priority,
+                std::function<void(size_t)> on_resize);
+
+    MemoryBroker &broker;
+
+    size_t minimum;
+
+    size_t maximum;
+
+    size_t size;
+
+    int priority;
+
+    // Called with the new size whenever the grant changes, while the lock of the broker is held
+    std::function<void(size_t)> on_resize;
+};
+
+/**
+ * Class sharing a pool of memory among the sorts that run in the process. A sort is admitted once its minimum grant is
+ * available, and waits until then. Sorts with a higher priority may take memory back from sorts with a lower priority
+ * (and, to be admitted, from sorts with the same priority), but never below their minimum. Part of the memory that is
+ * not granted is lent to the cache of free buffers (see AllocPool), and taken back as it is granted
+ */
+class MemoryBroker {
+public:
+    MemoryBroker(size_t pool_size);
+
+    ~MemoryBroker();
+
+    // Broker shared by all the sorts of the process. Its pool is a quarter of physical memory
+    static MemoryBroker& global();
+
+    /**
+     * Admit a sort that needs at least `minimum` bytes and can use up to `maximum`. Blocks until the minimum can be
+     * granted. Higher priorities are served first
+     */
+    std::unique_ptr<MemoryGrant> admit(size_t minimum, size_t maximum, int priority,
+                                       std::function<void(size_t)> on_resize);
+
+    size_t get_pool_size() {
+        return pool_size;
+    }
+
+    // Fraction of the pool that is granted right now
+    double get_utilization();
+
+    // Pool size, bytes granted now and at most, and how often sorts waited or gave memory back
+    std::string to_string();
+
+private:
+    friend class MemoryGrant;
+
+    size_t pool_size;
+
+    size_t granted {0};
+
+    size_t peak_granted {0};
+
+    size_t num_admitted {0};
+
+    size_t num_waited {0};
+
+    size_t reclaimed_bytes {0};
+
+    std::vector<MemoryGrant*> grants;
+
+    std::mutex mutex;
+
+    std::condition_variable released;
+
+    // Capacity that this broker has lent to the buffer cache
+    size_t cache_capacity {0};
+
+    // The buffer cache gets at most this fraction of the memory granted, out of the memory of the pool that is free
+    static const size_t CACHE_FRACTION = 4;
+
+    // Lend the buffer cache its share of the pool after the granted memory changed. Must be called with the lock held
+    void update_cache_capacity();
+
+    /**
+     * Take memory back from the grants whose priority is below `priority` (or equal if `include_equal` is set), lowest
+     * priority first, until `bytes` are free or nothing more can be taken. Must be called with the lock held
+     */
+    void reclaim(size_t bytes, int priority, bool include_equal, const MemoryGrant *requester);
+
+    void release(MemoryGrant *grant);
+};
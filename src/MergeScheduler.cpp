@@ -0,0 +1,206 @@
+#include "MergeScheduler.h"
+#include "SorterConfig.h"
+#include "ThreadPool.h"
+#include <algorithm>
+
+MergeScheduler::MergeScheduler(size_t num_threads, size_t memory_budget): memory_budget(memory_budget) {
+    std::vector<int> cpus = ThreadPool::allowed_cpus();
+    for (size_t i=0; i<num_threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        workers.back()->cpu = cpus.empty()? -1: cpus[i % cpus.size()];
+    }
+    // Steal from the workers that share the L2 cache first, then the L3 cache, then all the others
+    for (size_t i=0; i<num_threads; i++) {
+        auto distance = [&](size_t j) {
+            int cpu_a = workers[i]->cpu;
+            int cpu_b = workers[j]->cpu;
+            if (cpu_a < 0 || cpu_b < 0) {
+                return 2;
+            }
+            if (CacheInfo::shares_cache(cpu_a, cpu_b, 2)) {
+                return 0;
+            }
+            return CacheInfo::shares_cache(cpu_a, cpu_b, 3)? 1: 2;
+        };
+        auto& victims = workers[i]->victims;
+        for (size_t j=1; j<num_threads; j++) {
+            victims.push_back((i + j) % num_threads);
+        }
+        std::stable_sort(victims.begin(), victims.end(), [&](size_t a, size_t b) {
+            return distance(a) < distance(b);
+        });
+    }
+    for (size_t i=0; i<num_threads; i++) {
+        workers[i]->thread = std::thread(&MergeScheduler::worker_loop, this, i);
+        if (workers[i]->cpu >= 0) {
+            ThreadPool::pin_thread(workers[i]->thread, workers[i]->cpu);
+        }
+    }
+}
+
+MergeScheduler::~MergeScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    state_changed.notify_all();
+    for (auto& worker: workers) {
+        worker->thread.join();
+    }
+}
+
+bool MergeScheduler::execute_tasks(Task *root, const std::vector<Task*> &ready, bool merge_root,
+                                   const std::function<bool()> &interrupted) {
+    if (!merge_root && root->pending_inputs == 0) {
+        // Nothing to do below the root
+        tasks.clear();
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        root_task = root;
+        root_done = false;
+        cancelled = false;
+        this->merge_root = merge_root;
+        this->interrupted = interrupted;
+    }
+    // Sibling merges are next to each other in plan order, so each worker gets a contiguous range of them
+    for (size_t i=0; i<ready.size(); i++) {
+        push(i * workers.size() / ready.size(), ready[i]);
+    }
+    bool completed;
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_changed.wait(lock, [this] { return root_done || (cancelled && active == 0); });
+        completed = root_done;
+        root_task = nullptr;
+        this->interrupted = nullptr;
+    }
+    if (!completed) {
+        // Drop the merges that were never started. Cancelled merges do not push their parents, so no merge is added
+        // in the meantime
+        for (auto& worker: workers) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            std::lock_guard<std::mutex> state_lock(state_mutex);
+            queued -= worker->tasks.size();
+            worker->tasks.clear();
+        }
+        // Merges taken before their deque was cleared return without merging, but must be done with their tasks
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_changed.wait(lock, [this] { return active == 0; });
+    }
+    tasks.clear();
+    return completed;
+}
+
+void MergeScheduler::set_memory_budget(size_t memory_budget) {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    this->memory_budget = memory_budget;
+}
+
+void MergeScheduler::push(size_t worker_idx, Task *task) {
+    {
+        // The counters are updated under the lock of the deque, so that they always agree with the deques. The lock
+        // of a deque is always taken before state_mutex
+        std::lock_guard<std::mutex> lock(workers[worker_idx]->mutex);
+        workers[worker_idx]->tasks.push_back(task);
+        std::lock_guard<std::mutex> state_lock(state_mutex);
+        queued++;
+    }
+    state_changed.notify_all();
+}
+
+MergeScheduler::Task* MergeScheduler::take(size_t worker_idx) {
+    Task *task = nullptr;
+    {
+        // Newest merge of our own, whose inputs are most likely still in the cache
+        Worker &worker = *workers[worker_idx];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.tasks.empty()) {
+            task = worker.tasks.back();
+            worker.tasks.pop_back();
+            mark_active();
+        }
+    }
+    for (size_t i=0; task == nullptr && i<workers[worker_idx]->victims.size(); i++) {
+        // Oldest merge of another worker
+        Worker &victim = *workers[workers[worker_idx]->victims[i]];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            mark_active();
+        }
+    }
+    return task;
+}
+
+void MergeScheduler::mark_active() {
+    // Called with the lock of the deque that the merge was taken from held, so that a cancelled execute() cannot drop
+    // the merges between the pop and the count
+    std::lock_guard<std::mutex> lock(state_mutex);
+    queued--;
+    active++;
+}
+
+void MergeScheduler::run(size_t worker_idx, Task *task) {
+    // The inputs of a merge are released when it finishes, so only the outputs of the running merges add to the
+    // memory in use. A merge that does not fit is still started when nothing else is running
+    size_t memory = task->get_output_memory();
+    Task *root;
+    bool merge_root;
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_changed.wait(lock, [&] {
+            return cancelled || running == 0 || memory_in_use + memory <= memory_budget;
+        });
+        if (!cancelled && interrupted && interrupted()) {
+            cancelled = true;
+        }
+        if (cancelled) {
+            active--;
+            lock.unlock();
+            state_changed.notify_all();
+            return;
+        }
+        running++;
+        memory_in_use += memory;
+        root = root_task;
+        merge_root = this->merge_root;
+    }
+    task->merge();
+    Task *parent = task->parent;
+    bool inputs_of_root_done = false;
+    if (parent != nullptr && --parent->pending_inputs == 0) {
+        if (parent == root && !merge_root) {
+            inputs_of_root_done = true;
+        } else {
+            push(worker_idx, parent);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        running--;
+        active--;
+        memory_in_use -= memory;
+        if (task == root || inputs_of_root_done) {
+            root_done = true;
+        }
+    }
+    state_changed.notify_all();
+}
+
+void MergeScheduler::worker_loop(size_t worker_idx) {
+    while (true) {
+        Task *task = take(worker_idx);
+        if (task != nullptr) {
+            run(worker_idx, task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_changed.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Class executing the merge nodes of a plan concurrently on a pool of pinned worker threads. A merge becomes ready
+ * once all of its input merges are done. Every worker has its own deque of ready merges: it takes merges from the
+ * back of its own deque and steals from the front of the others, trying workers that share a cache with it first.
+ * The parent of a merge is queued on the worker that completed its last input, so that the input is still in that
+ * worker's cache. Merges are only started while the memory that they allocate for their output fits in the budget
+ */
+class MergeScheduler {
+public:
+    MergeScheduler(size_t num_threads, size_t memory_budget);
+
+    ~MergeScheduler();
+
+    /**
+     * Execute all the merge nodes of the plan with the given root that have not been merged yet. Returns once the
+     * root has been merged. If `merge_root` is false, only the merges below the root are executed. If `interrupted`
+     * returns true before a merge is started, no more merges are started and false is returned once the running
+     * ones are done
+     */
+    template<typename MergeNodeType>
+    bool execute(const std::shared_ptr<MergeNodeType> &root, bool merge_root = true,
+                 const std::function<bool()> &interrupted = nullptr) {
+        if (root->is_merged()) {
+            return true;
+        }
+        std::vector<Task*> ready;
+        Task *task = add_tasks(root, nullptr, ready);
+        return execute_tasks(task, ready, merge_root, interrupted);
+    }
+
+    void set_memory_budget(size_t memory_budget);
+
+private:
+    struct Task {
+        // Merge the inputs of the node, which must all have been merged
+        std::function<void()> merge;
+
+        // Bytes of memory that the merge allocates for its output
+        std::function<size_t()> get_output_memory;
+
+        Task *parent;
+
+        // Input merges that have not completed yet
+        std::atomic<size_t> pending_inputs;
+    };
+
+    struct Worker {
+        std::thread thread;
+
+        int cpu;
+
+        std::deque<Task*> tasks;
+
+        std::mutex mutex;
+
+        // Other workers in the order they are stolen from
+        std::vector<size_t> victims;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::vector<std::unique_ptr<Task>> tasks;
+
+    size_t memory_budget;
+
+    // Protects the fields below
+    std::mutex state_mutex;
+
+    std::condition_variable state_changed;
+
+    // Ready merges that no worker has taken yet
+    size_t queued {0};
+
+    // Merges that have been taken by a worker and have not finished
+    size_t active {0};
+
+    // Merges that are being executed and the output memory that they hold
+    size_t running {0};
+
+    size_t memory_in_use {0};
+
+    Task *root_task {nullptr};
+
+    bool root_done {false};
+
+    bool merge_root {true};
+
+    std::function<bool()> interrupted {nullptr};
+
+    // Set once `interrupted` has fired. Merges that have not started are dropped
+    bool cancelled {false};
+
+    bool stopping {false};
+
+    // Create the tasks for the subtree. Tasks without input merges are added to `ready` in plan order
+    template<typename MergeNodeType>
+    Task* add_tasks(const std::shared_ptr<MergeNodeType> &node, Task *parent, std::vector<Task*> &ready) {
+        tasks.push_back(std::make_unique<Task>());
+        Task *task = tasks.back().get();
+        task->merge = [node] {
+            node->merge();
+        };
+        task->get_output_memory = [node] {
+            return node->get_output_memory();
+        };
+        task->parent = parent;
+        size_t pending_inputs = 0;
+        for (auto& input: node->inputs) {
+            // Merges that completed before the plan was changed are read like runs
+            if (input->is_internal_node() && !std::static_pointer_cast<MergeNodeType>(input)->is_merged()) {
+                add_tasks(std::static_pointer_cast<MergeNodeType>(input), task, ready);
+                pending_inputs++;
+            }
+        }
+        task->pending_inputs = pending_inputs;
+        if (pending_inputs == 0) {
+            ready.push_back(task);
+        }
+        return task;
+    }
+
+    // Execute the tasks created for a plan, starting with the ready ones. `root` is the task of the root of the plan
+    bool execute_tasks(Task *root, const std::vector<Task*> &ready, bool merge_root,
+                       const std::function<bool()> &interrupted);
+
+    void push(size_t worker_idx, Task *task);
+
+    Task* take(size_t worker_idx);
+
+    // Count a merge that was taken from a deque as active
+    void mark_active();
+
+    void run(size_t worker_idx, Task *task);
+
+    void worker_loop(size_t worker_idx);
+};
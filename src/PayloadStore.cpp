@@ -0,0 +1,33 @@
+#include "PayloadStore.h"
+#include <algorithm>
+
+PayloadStore::PayloadStore(size_t payload_size, const std::string &spill_directory):
+        payload_size(payload_size), spill_directory(spill_directory) {
+    chunk_capacity = std::max(CHUNK_SIZE / payload_size, (size_t) 1);
+}
+
+uint32_t PayloadStore::append(const void *payload) {
+    FinalAssert (!gathering && num_payloads < UINT32_MAX);
+    if (get_next_chunk_size() > 0) {
+        auto chunk = Alloc::create(chunk_capacity * payload_size);
+        FinalAssert (chunk != nullptr);
+        chunks.push_back(std::move(chunk));
+    }
+    chunks.back()->write(payload, payload_size);
+    return num_payloads++;
+}
+
+void PayloadStore::spill() {
+    if (chunks.empty()) {
+        return;
+    }
+    if (file == nullptr) {
+        file = SpillFile::create(spill_directory);
+        FinalAssert (file != nullptr);
+    }
+    for (auto &chunk: chunks) {
+        file->write(chunk->get_addr(), chunk->get_size());
+    }
+    chunks.clear();
+    first_memory_id = num_payloads;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "defs.h"
+#include "Record.h"
+#include "Alloc.h"
+#include "SpillFile.h"
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Payloads of the records of a sort, kept apart from the keys in the order the records were added and addressed by
+ * row id. Payloads are appended to chunks in memory. When the sort spills, the chunks are appended to a file, so
+ * every payload is written at most once however many merges its key goes through. The payloads are gathered back in
+ * sorted order, one batch of rows at a time
+ */
+class PayloadStore {
+public:
+    PayloadStore(size_t payload_size, const std::string &spill_directory);
+
+    // Copy a payload into the store and return its row id
+    uint32_t append(const void *payload);
+
+    // Bytes of the chunks in memory
+    size_t get_memory_size() {
+        return chunks.size() * chunk_capacity * payload_size;
+    }
+
+    // Bytes of the chunk that the next payload starts, or 0 if it fits in the last chunk
+    size_t get_next_chunk_size() {
+        return ((num_payloads - first_memory_id) % chunk_capacity == 0)? chunk_capacity * payload_size: 0;
+    }
+
+    size_t get_payload_size() {
+        return payload_size;
+    }
+
+    // Move the payloads in memory to the spill file and free their chunks
+    void spill();
+
+    /**
+     * Copy the payloads of `count` rows to `output`, one after the other in the order of the rows. Payloads in memory
+     * are prefetched a few rows ahead of the copy, and the reads of all the spilled payloads of the batch are in
+     * flight at the same time. No more payloads may be added once the first batch has been gathered
+     */
+    template<typename RowType>
+    void gather(const RowType *rows, size_t count, char *output) {
+        if (!gathering) {
+            gathering = true;
+            if (file != nullptr) {
+                file->finish();
+            }
+        }
+        // The spilled payloads are all requested before any is waited for, so that the reads overlap
+        for (size_t i=0; i<count; i++) {
+            uint32_t row_id = rows[i].get_row_id();
+            if (row_id < first_memory_id) {
+                pending_reads.push_back(file->start_read((size_t) row_id * payload_size, output + i * payload_size,
+                                                         payload_size));
+            }
+        }
+        for (size_t i=0; i<count; i++) {
+            if (i + PREFETCH_ROWS < count && rows[i + PREFETCH_ROWS].get_row_id() >= first_memory_id) {
+                const char *ahead = memory_address(rows[i + PREFETCH_ROWS].get_row_id());
+                for (size_t offset=0; offset<payload_size; offset+=64) {
+                    __builtin_prefetch(ahead + offset);
+                }
+            }
+            uint32_t row_id = rows[i].get_row_id();
+            if (row_id >= first_memory_id) {
+                memcpy(output + i * payload_size, memory_address(row_id), payload_size);
+            }
+        }
+        for (auto &request: pending_reads) {
+            file->wait_for_read(request);
+        }
+        pending_reads.clear();
+    }
+
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    // Rows ahead of the copy whose payloads are prefetched
+    static const size_t PREFETCH_ROWS = 8;
+
+private:
+    size_t payload_size;
+
+    // Payloads per chunk
+    size_t chunk_capacity;
+
+    std::string spill_directory;
+
+    // Chunks in memory. Chunk i holds the payloads from row id first_memory_id + i * chunk_capacity on
+    std::vector<std::shared_ptr<Alloc>> chunks;
+
+    uint32_t first_memory_id {0};
+
+    uint32_t num_payloads {0};
+
+    // Holds the payloads of the row ids below first_memory_id, in order
+    std::shared_ptr<SpillFile> file {nullptr};
+
+    bool gathering {false};
+
+    std::vector<std::shared_ptr<IORequest>> pending_reads;
+
+    inline const char* memory_address(uint32_t row_id) {
+        uint32_t index = row_id - first_memory_id;
+        return static_cast<const char*>(chunks[index / chunk_capacity]->get_addr()) +
+               (index % chunk_capacity) * payload_size;
+    }
+};
@@ -0,0 +1,11 @@
+#include "Planner.h"
+#include "Sorter.h"
+
+std::string PlanReport::to_string() const {
+    return description + ", " + std::to_string(num_merges) + " merges, predicted "
+        + std::to_string(predicted_seconds * 1000) + " ms and " + std::to_string(predicted_bytes) + " bytes ("
+        + std::to_string(predicted_disk_bytes) + " on disk), actual " + std::to_string(actual_seconds * 1000)
+        + " ms and " + std::to_string(actual_bytes) + " bytes (" + std::to_string(actual_disk_bytes) + " on disk)";
+}
+
+template class BasicMergePlanner<SortSchema>;
@@ -0,0 +1,288 @@
+#pragma once
+#include "defs.h"
+#include "Alloc.h"
+#include "SorterConfig.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+template<typename RowSchema>
+class BasicSortNode;
+
+template<typename RowSchema>
+class BasicMergeNode;
+
+/**
+ * Struct describing a merge plan chosen by the MergePlanner, with its predicted cost next to the cost that was
+ * measured when it was executed
+ */
+struct PlanReport {
+    std::string description;
+
+    size_t num_merges {0};
+
+    double predicted_seconds {0};
+
+    // Bytes read and written by all the merges, and the part of them that goes to disk
+    size_t predicted_bytes {0};
+
+    size_t predicted_disk_bytes {0};
+
+    double actual_seconds {0};
+
+    // Updated by the merges as they complete
+    std::atomic<size_t> actual_bytes {0};
+
+    std::atomic<size_t> actual_disk_bytes {0};
+
+    std::string to_string() const;
+};
+
+/**
+ * Class to build merge plans by estimating their cost. Plans have the shape that the Sorter always used: the smallest
+ * runs are merged first, with one fan-in for the intermediate merges and one for the final merge, and the first merge
+ * takes just enough runs for the last level to be full. The planner tries each pair of fan-ins and keeps the plan
+ * with the lowest cost under the CostModel of the config, which charges for row comparisons and for moving bytes
+ * between cache, memory and disk. Merges whose output does not fit in the memory budget are spilled. Spilled inputs
+ * of a merge share the read buffer memory, so the fan-in also decides the size of their blocks and the number of
+ * disk requests
+ */
+template<typename RowSchema>
+class BasicMergePlanner {
+    typedef BasicRow<RowSchema> RowType;
+
+    typedef BasicSortNode<RowSchema> SortNode;
+
+    typedef BasicMergeNode<RowSchema> MergeNode;
+
+public:
+    BasicMergePlanner(const SorterConfig &config): config(config) {
+        report = std::make_shared<PlanReport>();
+    }
+
+    /**
+     * Create the cheapest plan over the runs and return the root node. If `spill_root` is set, the output of the root
+     * is written to disk
+     */
+    std::shared_ptr<MergeNode> plan(std::vector<std::shared_ptr<SortNode>> &runs, bool spill_root) {
+        std::vector<PlanItem> items;
+        bool any_on_disk = spill_root;
+        size_t total_size = 0;
+        for (auto& run: runs) {
+            items.push_back(PlanItem {run->get_size(), run->is_spilled(), run});
+            any_on_disk |= run->is_spilled();
+            total_size += run->get_size();
+        }
+        runs.clear();
+        std::stable_sort(items.begin(), items.end(), [](const PlanItem &a, const PlanItem &b) {
+            return a.size < b.size;
+        });
+        // The candidate plans are costed without the nodes
+        std::vector<PlanItem> sizes;
+        for (auto& item: items) {
+            sizes.push_back(PlanItem {item.size, item.on_disk, nullptr});
+        }
+        any_on_disk |= (total_size > config.memory_budget);
+
+        // The configured fan-in is the best one for merges in memory. Merges of spilled runs go up to the disk fan-in,
+        // as far as the read buffers allow, so that a smaller memory budget also means a smaller fan-in
+        size_t max_fan_in = config.fan_in;
+        if (any_on_disk) {
+            max_fan_in = min(config.disk_fan_in, max(config.memory_budget / 2 / MIN_READ_BLOCK, (size_t) 3) - 1);
+        }
+        max_fan_in = min(max_fan_in, items.size());
+        std::vector<size_t> candidates;
+        for (size_t fan_in = 2; fan_in < max_fan_in; fan_in *= 2) {
+            candidates.push_back(fan_in);
+        }
+        candidates.push_back(max(max_fan_in, (size_t) 2));
+
+        PlanCost best;
+        size_t best_inner = 0, best_final = 0;
+        for (auto final_fan_in: candidates) {
+            for (auto inner_fan_in: candidates) {
+                if (items.size() <= final_fan_in && inner_fan_in != candidates[0]) {
+                    // Single merge, the intermediate fan-in does not matter
+                    continue;
+                }
+                PlanCost cost = build_plan(sizes, inner_fan_in, final_fan_in, spill_root, false, nullptr);
+                if (best_final == 0 || cost.seconds < best.seconds) {
+                    best = cost;
+                    best_inner = inner_fan_in;
+                    best_final = final_fan_in;
+                }
+            }
+        }
+
+        std::shared_ptr<MergeNode> root;
+        build_plan(items, best_inner, best_final, spill_root, true, &root);
+        report->description = std::to_string(items.size()) + " runs, ";
+        if (best.num_merges > 1) {
+            report->description += "fan-in " + std::to_string(best_inner) + " (read block "
+                + std::to_string(read_block_size(best_inner)) + ") with final ";
+        }
+        report->description += "fan-in " + std::to_string(best_final) + " (read block "
+            + std::to_string(read_block_size(best_final)) + ")";
+        report->num_merges = best.num_merges;
+        report->predicted_seconds = best.seconds;
+        report->predicted_bytes = best.bytes;
+        report->predicted_disk_bytes = best.disk_bytes;
+        return root;
+    }
+
+    std::shared_ptr<PlanReport>& get_report() {
+        return report;
+    }
+
+private:
+    struct PlanItem {
+        size_t size;
+
+        bool on_disk;
+
+        std::shared_ptr<SortNode> node;
+    };
+
+    struct PlanCost {
+        double seconds {0};
+
+        size_t bytes {0};
+
+        size_t disk_bytes {0};
+
+        size_t num_merges {0};
+    };
+
+    const SorterConfig &config;
+
+    std::shared_ptr<PlanReport> report;
+
+    // Smallest read block of a spilled input
+    static const size_t MIN_READ_BLOCK = 1 << 14;
+
+    static const size_t MAX_READ_BLOCK = 1 << 22;
+
+    // Size of the read blocks of each spilled input of a merge with the given fan-in
+    size_t read_block_size(size_t fan_in) {
+        // Half of the memory budget is shared by the blocks of the inputs and the forecast block
+        size_t block_size = config.memory_budget / 2 / (fan_in + 1);
+        block_size = max(min(block_size, MAX_READ_BLOCK), MIN_READ_BLOCK);
+        return RoundDown(block_size, Alloc::PAGE_SIZE);
+    }
+
+    /**
+     * Build the plan with the given fan-ins and return its cost. MergeNodes are only created if `build` is set, in
+     * which case `root` is set to the root node
+     */
+    PlanCost build_plan(const std::vector<PlanItem> &runs, size_t inner_fan_in, size_t final_fan_in, bool spill_root,
+                        bool build, std::shared_ptr<MergeNode> *root) {
+        // Merge smaller-sized runs first. The runs are sorted by size and the outputs of the merges come out in order
+        // of size as well, so the smallest node is always at the front of one of the two queues
+        std::deque<PlanItem> sorted_runs(runs.begin(), runs.end());
+        std::deque<PlanItem> merged_runs;
+        auto take_smallest = [&] {
+            bool from_runs = !sorted_runs.empty()
+                && (merged_runs.empty() || sorted_runs.front().size <= merged_runs.front().size);
+            auto& queue = from_runs? sorted_runs: merged_runs;
+            PlanItem item = std::move(queue.front());
+            queue.pop_front();
+            return item;
+        };
+        PlanCost total;
+
+        size_t W = runs.size();
+        // The first merge makes the number of remaining runs come out at exactly the final fan-in
+        size_t fan_in = (W > final_fan_in)? (W - final_fan_in - 1) % (inner_fan_in - 1) + 2: W;
+        while (true) {
+            bool is_root = (sorted_runs.size() + merged_runs.size() == fan_in);
+            std::vector<PlanItem> selected_nodes;
+            size_t size = 0;
+            for (size_t i=0; i<fan_in; i++) {
+                selected_nodes.push_back(take_smallest());
+                size += selected_nodes.back().size;
+            }
+            // Output does not fit in memory
+            bool spill_output = (size > config.memory_budget) || (is_root && spill_root);
+            PlanCost cost = merge_cost(selected_nodes, size, spill_output);
+            total.seconds += cost.seconds;
+            total.bytes += cost.bytes;
+            total.disk_bytes += cost.disk_bytes;
+            total.num_merges++;
+
+            PlanItem merged {size, spill_output, nullptr};
+            if (build) {
+                std::vector<std::shared_ptr<SortNode>> inputs;
+                for (auto& node: selected_nodes) {
+                    inputs.push_back(std::move(node.node));
+                }
+                auto new_merge_node = std::make_shared<MergeNode>(inputs);
+                if (spill_output) {
+                    new_merge_node->spill_to(config.spill_directory, config.get_spill_layout<RowType>());
+                }
+                new_merge_node->set_read_block_size(read_block_size(fan_in));
+                new_merge_node->set_prefault_output(config.prefault);
+                new_merge_node->set_prefetch_distance(config.prefetch_distance);
+                new_merge_node->set_streaming_stores(size >= config.streaming_store_size);
+                new_merge_node->set_report(report);
+                merged.node = new_merge_node;
+                if (is_root) {
+                    *root = std::move(new_merge_node);
+                }
+            }
+            if (is_root) {
+                break;
+            }
+            merged_runs.push_back(std::move(merged));
+            size_t remaining = sorted_runs.size() + merged_runs.size();
+            fan_in = (remaining > final_fan_in)? inner_fan_in: remaining;
+        }
+        return total;
+    }
+
+    // Cost of a single merge
+    PlanCost merge_cost(const std::vector<PlanItem> &inputs, size_t size, bool spill_output) {
+        const CostModel &model = config.cost_model;
+        PlanCost cost;
+        cost.num_merges = 1;
+        double rows = size / sizeof(RowType);
+        cost.seconds += rows * (std::ceil(std::log2(inputs.size())) * model.compare_ns + model.row_ns) * 1e-9;
+
+        size_t block_size = read_block_size(inputs.size());
+        size_t memory_bytes = 0;
+        // Spilled runs may take less room on disk than in memory
+        SpillLayout layout = config.get_spill_layout<RowType>();
+        for (auto& input: inputs) {
+            if (input.on_disk) {
+                cost.seconds += layout.get_stored_size(input.size) / model.disk_read_bandwidth;
+                cost.seconds += (input.size + block_size - 1) / block_size * model.disk_request_seconds;
+                cost.disk_bytes += input.size;
+            } else {
+                memory_bytes += input.size;
+            }
+        }
+        // Inputs that fit in the cache together are read from there
+        double memory_bandwidth = (memory_bytes <= config.cache_size)? model.cache_bandwidth: model.memory_bandwidth;
+        cost.seconds += memory_bytes / memory_bandwidth;
+        cost.bytes += size;
+
+        if (spill_output) {
+            cost.seconds += layout.get_stored_size(size) / model.disk_write_bandwidth;
+            cost.disk_bytes += size;
+            cost.bytes += size;
+        } else if (!config.streaming_merge) {
+            // Streamed outputs are never written out
+            cost.seconds += size / ((size <= config.cache_size)? model.cache_bandwidth: model.memory_bandwidth);
+            cost.bytes += size;
+        }
+        return cost;
+    }
+};
+
+typedef BasicMergePlanner<SortSchema> MergePlanner;
+
+// Instantiated in Planner.cpp
+extern template class BasicMergePlanner<SortSchema>;
@@ -1,95 +1,239 @@
 #pragma once
 
+#include "Schema.h"
 #include <stdlib.h>
 #include <cstdint>
 #include <string>
 #include <iostream>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 // OVC is represented by a 64 bit integer. First 32 bits -> offset, next 32 bits -> value
 #define OVC uint64_t
 
 
-// Arity for ascending OVC
-const uint64_t ARITY = 3;
 const uint64_t OFFSET_MULTIPLIER = (1ll<<32);
 
-class Row {
+template<typename RowSchema>
+class BasicRow;
+
+/**
+ * Record with the key columns of `Schema<Columns...>`, stored as normalized 32-bit key words. Offsets of the
+ * offset-value codes count key words, and the value of a code is a key word. Trivially copyable, so runs are moved
+ * around with memcpy, and without a vtable pointer, so a record is the code and the key words rounded up to 16 bytes
+ */
+template<typename... Columns>
+class BasicRow<Schema<Columns...>> {
 public:
-    Row(uint32_t x, uint32_t y, uint32_t z) {
-        values[0] = x;
-        values[1] = y;
-        values[2] = z;
-        ovc = ARITY * OFFSET_MULTIPLIER + x;
+    typedef Schema<Columns...> RowSchema;
+
+    // Arity for ascending OVC
+    static constexpr uint32_t KEY_WORDS = RowSchema::KEY_WORDS;
+
+    static_assert(KEY_WORDS <= 32, "Differing key words are collected in a 32-bit mask");
+
+    // Whether the storage words after the key leave room for a row id
+    static constexpr bool HAS_ROW_ID = KEY_WORDS % 4 != 0;
+
+    BasicRow(Columns... columns) {
+        encode_columns(std::index_sequence_for<Columns...>(), columns...);
+        reset_ovc();
     }
 
-    Row() {
-        values[0] = 0;
-        values[1] = 0;
-        values[2] = 0;
-        ovc = ARITY * OFFSET_MULTIPLIER;
+    BasicRow() {
+        ovc = KEY_WORDS * OFFSET_MULTIPLIER;
     }
 
-    virtual ~Row() = default;
+    static BasicRow* generate_random() {
+        BasicRow* d = new BasicRow();
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            d->words[i] = rand();
+        }
+        d->reset_ovc();
+        return d;
+    }
 
-    static Row* generate_random() {
-        uint32_t x = rand();
-        uint32_t y = rand();
-        uint32_t z = rand();
-        Row* d = new Row(x, y, z);
+    // Record with key words drawn from `generator`, which leaves rand() alone
+    template<typename Generator>
+    static BasicRow generate_random(Generator &generator) {
+        BasicRow d;
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            d.words[i] = generator();
+        }
+        d.reset_ovc();
         return d;
     }
 
     // Returns a record representing an infinite value (used as an invalid sentinel value in tournament tree)
-    static Row inf() {
-        Row d {UINT32_MAX, UINT32_MAX, UINT32_MAX};
+    static BasicRow inf() {
+        BasicRow d;
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            d.words[i] = UINT32_MAX;
+        }
+        d.reset_ovc();
         return d;
     }
 
-    inline bool operator <(Row &other) {
+    // Value of column `column`
+    template<size_t column>
+    inline auto get_column() const {
+        return RowSchema::template decode<column>(words);
+    }
+
+    // Whether this is the record returned by inf()
+    inline bool is_inf() const {
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            if (words[i] != UINT32_MAX) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool operator <(BasicRow &other) {
         if (ovc != other.ovc) {
             return ovc < other.ovc;
         }
-        uint32_t pos = ARITY - (ovc >> 32);
-        uint32_t i=pos+1;
-        for (; i<ARITY; i++) {
-            if (values[i] < other.values[i]) {
-                other.ovc = (ARITY-i) * OFFSET_MULTIPLIER + other.values[i];
-                return true;
-            } else if (values[i] > other.values[i]) {
-                ovc = (ARITY-i) * OFFSET_MULTIPLIER + values[i];
-                return false;
-            }
+        return break_tie(*this, ovc, other, other.ovc, KEY_WORDS - (ovc >> 32) + 1);
+    }
+
+    // Bit i is set if key word i differs between the two records
+    inline uint32_t differing_words(const BasicRow &other) const {
+#ifdef __SSE2__
+        // Four key words are compared at once. The words after the key fill the last lane and are masked out
+        uint64_t equal = 0;
+        for (uint32_t lane=0; lane<STORAGE_WORDS/4; lane++) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words) + lane);
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(other.words) + lane);
+            equal |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) << (4 * lane);
         }
-        return false;
+        return ~equal & ((1ull << KEY_WORDS) - 1);
+#else
+        uint32_t differing = 0;
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            differing |= (uint32_t) (words[i] != other.words[i]) << i;
+        }
+        return differing;
+#endif
     }
 
-    inline bool operator ==(const Row &other) {
-        return values[0] == other.values[1] && values[1] == other.values[1] && values[2] == other.values[2];
+    /**
+     * Break a tie between the equal codes `a_ovc` and `b_ovc` of records `a` and `b`, which agree on the key words
+     * before `first_word`. The code of the loser is made relative to the winner, and if the keys are equal `a` loses
+     * and is coded as a duplicate. Returns whether `a` wins. Only the search for the first differing word branches
+     */
+    static inline bool break_tie(const BasicRow &a, OVC &a_ovc, const BasicRow &b, OVC &b_ovc, uint32_t first_word) {
+        uint32_t differing = a.differing_words(b) & (~0ull << first_word);
+        bool duplicate = differing == 0;
+        uint32_t i = __builtin_ctz(differing | 1u << (KEY_WORDS-1));
+        uint32_t a_value = a.words[i];
+        uint32_t b_value = b.words[i];
+        bool a_wins = !duplicate & (a_value < b_value);
+        // Masks rather than conditionals, which the compiler would turn back into branches
+        uint32_t loser_value = a_value ^ ((a_value ^ b_value) & -(uint32_t) a_wins);
+        OVC code = ((KEY_WORDS-i) * OFFSET_MULTIPLIER + loser_value) & -(uint64_t) !duplicate;
+        *(a_wins? &b_ovc: &a_ovc) = code;
+        return a_wins;
     }
 
-    inline void witness(const Row &other) {
-        this->values[0] ^= other.values[0];
-        this->values[1] ^= other.values[1];
-        this->values[2] ^= other.values[2];
+    inline bool operator ==(const BasicRow &other) {
+        return differing_words(other) == 0;
+    }
+
+    inline void witness(const BasicRow &other) {
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            words[i] ^= other.words[i];
+        }
     }
 
     // For debugging
     std::string to_string() {
-        std::string res = "v0: " + std::to_string(values[0]) + ", v1: " + std::to_string(values[1]) 
-            + ", v2: " + std::to_string(values[2]);
+        std::string res;
+        for (uint32_t i=0; i<KEY_WORDS; i++) {
+            res += (i? ", v": "v") + std::to_string(i) + ": " + std::to_string(words[i]);
+        }
         return res;
     }
 
+    // Key word `i`
+    inline uint32_t get_value(uint32_t i) const {
+        return words[i];
+    }
+
+    // Row id of the payload of the record when the payloads are sorted apart from the keys. It is kept in the storage
+    // word after the key, which comparisons and codes leave alone, so it moves with the key through every merge
+    inline uint32_t get_row_id() const {
+        static_assert(HAS_ROW_ID, "The key leaves no storage word for a row id");
+        return words[KEY_WORDS];
+    }
+
+    inline void set_row_id(uint32_t row_id) {
+        static_assert(HAS_ROW_ID, "The key leaves no storage word for a row id");
+        words[KEY_WORDS] = row_id;
+    }
+
+    // Code relative to negative infinity, i.e. for the first record of a run
+    inline void reset_ovc() {
+        ovc = KEY_WORDS * OFFSET_MULTIPLIER + words[0];
+    }
+
+    /**
+     * Compare with a record that precedes this one in the output. If this record is not smaller, set its offset-value
+     * code relative to `prev` and return true. Otherwise return false and leave the code unchanged
+     */
+    inline bool code_relative_to(const BasicRow &prev) {
+        uint32_t differing = differing_words(prev);
+        if (differing == 0) {
+            ovc = 0;
+            return true;
+        }
+        uint32_t i = __builtin_ctz(differing);
+        if (words[i] < prev.words[i]) {
+            return false;
+        }
+        ovc = (KEY_WORDS-i) * OFFSET_MULTIPLIER + words[i];
+        return true;
+    }
+
+    // Compare the key columns without using offset-value codes. Equal keys compare their last words, so there is no
+    // branch
+    inline bool key_less(const BasicRow &other) const {
+        uint32_t i = __builtin_ctz(differing_words(other) | 1u << (KEY_WORDS-1));
+        return words[i] < other.words[i];
+    }
+
     // For counting inversions in witness operator
-    bool naive_lte(const Row &other) {
-        if (values[0] < other.values[0]) return true;
-        if (values[1] < other.values[1]) return true;
-        return values[2] <= other.values[2];
+    bool naive_lte(const BasicRow &other) {
+        for (uint32_t i=0; i+1<KEY_WORDS; i++) {
+            if (words[i] < other.words[i]) return true;
+        }
+        return words[KEY_WORDS-1] <= other.words[KEY_WORDS-1];
     }
 
     OVC ovc;
 
 private:
-    uint32_t values[3];
+    // Whole vectors of four words, which differing_words() loads at once
+    static constexpr uint32_t STORAGE_WORDS = (KEY_WORDS + 3) / 4 * 4;
+
+    uint32_t words[STORAGE_WORDS] {};
+
+    template<size_t... Indexes>
+    inline void encode_columns(std::index_sequence<Indexes...>, Columns... columns) {
+        (RowSchema::template encode<Indexes>(columns, words), ...);
+    }
+};
+
+// Schema the sorter is compiled for
+typedef Schema<uint32_t, uint32_t, uint32_t> SortSchema;
+
+typedef BasicRow<SortSchema> Row;
+
+// Arity for ascending OVC
+const uint64_t ARITY = Row::KEY_WORDS;
 
-    char padding[4]; // for alignment. Since the size of a single node is 32 bytes, a single node will not cross cache line boundaries
-};
\ No newline at end of file
+static_assert(std::is_trivially_copyable<Row>::value, "Rows are copied with memcpy");
+static_assert(sizeof(Row) == sizeof(OVC) + (Row::KEY_WORDS + 3) / 4 * 16, "Row has no vtable pointer or extra padding");
\ No newline at end of file
@@ -0,0 +1,7 @@
+#include "RunSort.h"
+
+template Row* radix_sort(Row *rows, size_t count, Row *scratch);
+
+template void code_sorted_run(Row *rows, size_t count);
+
+template void sort_blocks(Row *rows, size_t count);
@@ -0,0 +1,185 @@
+#pragma once
+#include "Record.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+// Byte `pass` of the key, counting from the least significant byte of the last column
+template<typename RowType>
+inline uint8_t key_byte(const RowType &row, uint32_t pass) {
+    return row.get_value(RowType::KEY_WORDS - 1 - pass/4) >> (8 * (pass%4));
+}
+
+/**
+ * Sort `count` rows by their key with an LSD radix sort, one byte per pass. `scratch` must have room for `count`
+ * rows. Passes in which all the rows have the same byte are skipped. Returns the buffer that holds the sorted rows
+ * (either `rows` or `scratch`). No memory is allocated
+ */
+template<typename RowType>
+RowType* radix_sort(RowType *rows, size_t count, RowType *scratch) {
+    // Number of bytes in the key
+    constexpr uint32_t KEY_BYTES = RowType::KEY_WORDS * sizeof(uint32_t);
+
+    uint32_t histograms[KEY_BYTES][256];
+    memset(histograms, 0, sizeof(histograms));
+    // Count all the digits in a single pass over the rows
+    for (size_t i=0; i<count; i++) {
+        for (uint32_t pass=0; pass<KEY_BYTES; pass++) {
+            histograms[pass][key_byte(rows[i], pass)]++;
+        }
+    }
+
+    RowType *src = rows;
+    RowType *dst = scratch;
+    for (uint32_t pass=0; pass<KEY_BYTES; pass++) {
+        uint32_t *histogram = histograms[pass];
+        if (count == 0 || histogram[key_byte(src[0], pass)] == count) {
+            // All the rows have the same digit. The pass would not change the order
+            continue;
+        }
+        // Turn the counts into the start offset of each bucket
+        uint32_t offset = 0;
+        for (uint32_t digit=0; digit<256; digit++) {
+            uint32_t bucket_size = histogram[digit];
+            histogram[digit] = offset;
+            offset += bucket_size;
+        }
+        for (size_t i=0; i<count; i++) {
+            memcpy(static_cast<void*>(&dst[histogram[key_byte(src[i], pass)]++]), &src[i], sizeof(RowType));
+        }
+        RowType *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+// Set the offset-value code of each row of a sorted run relative to its predecessor
+template<typename RowType>
+void code_sorted_run(RowType *rows, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    rows[0].reset_ovc();
+    for (size_t i=1; i<count; i++) {
+        rows[i].code_relative_to(rows[i-1]);
+    }
+}
+
+// Rows in a block sorted by sort_blocks()
+const size_t SORTED_BLOCK_ROWS = 16;
+
+typedef unsigned __int128 BlockKey;
+
+// Key of a row as a single integer that orders like the columns, with the position of the row in the block in the
+// lowest bits. Only keys of up to 3 words fit
+template<typename RowType>
+inline BlockKey block_key(const RowType &row, uint32_t position) {
+    static_assert(RowType::KEY_WORDS <= 3, "The key words and the position of a row must fit a BlockKey");
+    BlockKey key = 0;
+    for (uint32_t i=0; i<RowType::KEY_WORDS; i++) {
+        key |= (BlockKey) row.get_value(i) << (32 * (3 - i));
+    }
+    return key | position;
+}
+
+// Pair of positions whose keys are put in order, the smaller one first
+struct Comparator {
+    uint8_t low;
+    uint8_t high;
+};
+
+// Comparators of the bitonic sorting network for SORTED_BLOCK_ROWS keys, in the order they are applied
+constexpr auto bitonic_network() {
+    constexpr size_t levels = __builtin_ctzll(SORTED_BLOCK_ROWS);
+    std::array<Comparator, SORTED_BLOCK_ROWS / 2 * levels * (levels + 1) / 2> network {};
+    size_t n = 0;
+    for (size_t k = 2; k <= SORTED_BLOCK_ROWS; k <<= 1) {
+        for (size_t j = k >> 1; j > 0; j >>= 1) {
+            for (size_t i = 0; i < SORTED_BLOCK_ROWS; i++) {
+                size_t l = i ^ j;
+                if (l > i) {
+                    // Sequences alternate between ascending and descending until the last merge
+                    bool ascending = (i & k) == 0;
+                    network[n++] = ascending? Comparator {(uint8_t) i, (uint8_t) l}
+                                             : Comparator {(uint8_t) l, (uint8_t) i};
+                }
+            }
+        }
+    }
+    return network;
+}
+
+inline constexpr auto BITONIC_NETWORK = bitonic_network();
+
+// Put two keys in order without a branch
+inline void compare_exchange(BlockKey &low, BlockKey &high) {
+    BlockKey swap = (low ^ high) & -(BlockKey) (high < low);
+    low ^= swap;
+    high ^= swap;
+}
+
+/**
+ * Put the rows at two positions of a block of `size` rows in order, for keys that do not fit a BlockKey. The network
+ * moves positions and the keys are compared in place. Positions past the end of a short block go after all the rows.
+ * Like the integer keys, the positions are swapped with a mask, and positions past the end compare a row of the block
+ * instead, whose result is then masked out
+ */
+template<typename RowType>
+inline void compare_exchange(const RowType *rows, size_t size, uint8_t &low, uint8_t &high) {
+    bool past_end = (low >= size) | (high >= size);
+    bool key_swap = rows[std::min<size_t>(high, size - 1)].key_less(rows[std::min<size_t>(low, size - 1)]);
+    bool swap = (past_end & (high < low)) | (!past_end & key_swap);
+    uint8_t mask = (low ^ high) & -(uint8_t) swap;
+    low ^= mask;
+    high ^= mask;
+}
+
+/**
+ * Sort every block of SORTED_BLOCK_ROWS rows (and the shorter last block) in place with a bitonic sorting network, and
+ * code each block as a run of its own. Keys of up to 3 words are sorted as integers with branch-free compare-exchanges,
+ * wider keys through their positions, also without branches. No memory is allocated
+ */
+template<typename RowType>
+void sort_blocks(RowType *rows, size_t count) {
+    // Position in the block of the row that goes to each position of the output
+    uint8_t order[SORTED_BLOCK_ROWS];
+    alignas(RowType) char block[SORTED_BLOCK_ROWS * sizeof(RowType)];
+    for (size_t start=0; start<count; start+=SORTED_BLOCK_ROWS) {
+        RowType *block_rows = rows + start;
+        size_t block_size = std::min(SORTED_BLOCK_ROWS, count - start);
+        if constexpr (RowType::KEY_WORDS <= 3) {
+            BlockKey keys[SORTED_BLOCK_ROWS];
+            for (uint32_t i=0; i<SORTED_BLOCK_ROWS; i++) {
+                // A short block is filled up with keys above all others
+                keys[i] = (i < block_size)? block_key(block_rows[i], i): ~(BlockKey) 0;
+            }
+            for (auto comparator: BITONIC_NETWORK) {
+                compare_exchange(keys[comparator.low], keys[comparator.high]);
+            }
+            for (uint32_t i=0; i<SORTED_BLOCK_ROWS; i++) {
+                order[i] = (uint8_t) keys[i];
+            }
+        } else {
+            for (uint32_t i=0; i<SORTED_BLOCK_ROWS; i++) {
+                order[i] = i;
+            }
+            for (auto comparator: BITONIC_NETWORK) {
+                compare_exchange(block_rows, block_size, order[comparator.low], order[comparator.high]);
+            }
+        }
+        // Move the rows into the order of their keys
+        memcpy(block, static_cast<void*>(block_rows), block_size * sizeof(RowType));
+        for (size_t i=0; i<block_size; i++) {
+            memcpy(static_cast<void*>(&block_rows[i]), block + order[i] * sizeof(RowType), sizeof(RowType));
+        }
+        code_sorted_run(block_rows, block_size);
+    }
+}
+
+// Run sorts of the rows the sorter is compiled for, which are instantiated in RunSort.cpp
+extern template Row* radix_sort(Row *rows, size_t count, Row *scratch);
+
+extern template void code_sorted_run(Row *rows, size_t count);
+
+extern template void sort_blocks(Row *rows, size_t count);
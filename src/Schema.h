@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Order-preserving encoding of a key column as BITS bits. Comparing the encoded values as unsigned integers orders
+ * the columns like their values. Narrow columns keep their width, so that several of them share a key word
+ */
+template<typename T>
+struct KeyNormalizer;
+
+template<>
+struct KeyNormalizer<uint8_t> {
+    static constexpr size_t BITS = 8;
+
+    static inline uint64_t encode(uint8_t value) {
+        return value;
+    }
+
+    static inline uint8_t decode(uint64_t bits) {
+        return bits;
+    }
+};
+
+template<>
+struct KeyNormalizer<uint16_t> {
+    static constexpr size_t BITS = 16;
+
+    static inline uint64_t encode(uint16_t value) {
+        return value;
+    }
+
+    static inline uint16_t decode(uint64_t bits) {
+        return bits;
+    }
+};
+
+template<>
+struct KeyNormalizer<uint32_t> {
+    static constexpr size_t BITS = 32;
+
+    static inline uint64_t encode(uint32_t value) {
+        return value;
+    }
+
+    static inline uint32_t decode(uint64_t bits) {
+        return bits;
+    }
+};
+
+template<>
+struct KeyNormalizer<int32_t> {
+    static constexpr size_t BITS = 32;
+
+    // Flipping the sign bit moves the negative values below the positive ones
+    static inline uint64_t encode(int32_t value) {
+        return (uint32_t) value ^ (1u << 31);
+    }
+
+    static inline int32_t decode(uint64_t bits) {
+        return (int32_t) ((uint32_t) bits ^ (1u << 31));
+    }
+};
+
+template<>
+struct KeyNormalizer<uint64_t> {
+    static constexpr size_t BITS = 64;
+
+    static inline uint64_t encode(uint64_t value) {
+        return value;
+    }
+
+    static inline uint64_t decode(uint64_t bits) {
+        return bits;
+    }
+};
+
+template<>
+struct KeyNormalizer<int64_t> {
+    static constexpr size_t BITS = 64;
+
+    static inline uint64_t encode(int64_t value) {
+        return (uint64_t) value ^ (1ull << 63);
+    }
+
+    static inline int64_t decode(uint64_t bits) {
+        return (int64_t) (bits ^ (1ull << 63));
+    }
+};
+
+template<>
+struct KeyNormalizer<double> {
+    static constexpr size_t BITS = 64;
+
+    /**
+     * Positive numbers get the sign bit set, negative numbers have all bits flipped so that a larger magnitude sorts
+     * lower. -0.0 sorts just below 0.0, and NaNs with the sign bit clear sort above infinity
+     */
+    static inline uint64_t encode(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits ^ ((bits >> 63)? ~0ull: 1ull << 63);
+    }
+
+    static inline double decode(uint64_t bits) {
+        bits ^= (bits >> 63)? 1ull << 63: ~0ull;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+/**
+ * Key columns of the records of a sort, most significant first. The columns are normalized (see KeyNormalizer) and
+ * concatenated into a string of bits that is stored in 32-bit key words, first bit first. Records are compared and
+ * offset-value coded one key word at a time whatever the column types. A u8 and a u16 column share a word, and a
+ * column may straddle two or three words
+ */
+template<typename... Columns>
+struct Schema {
+    static constexpr size_t COLUMNS = sizeof...(Columns);
+
+    static constexpr size_t KEY_BITS = (KeyNormalizer<Columns>::BITS + ...);
+
+    static constexpr size_t KEY_WORDS = (KEY_BITS + 31) / 32;
+
+    template<size_t column>
+    using Column = std::tuple_element_t<column, std::tuple<Columns...>>;
+
+    // First bit of column `column` in the key
+    static constexpr size_t first_bit(size_t column) {
+        constexpr size_t bits[] = {KeyNormalizer<Columns>::BITS...};
+        size_t bit = 0;
+        for (size_t i=0; i<column; i++) {
+            bit += bits[i];
+        }
+        return bit;
+    }
+
+    // Number of leading columns that lie within the first `words` key words. The first word is the value of the code
+    // of a record relative to negative infinity, which alone orders records on this prefix of their columns
+    static constexpr size_t prefix_columns(size_t words) {
+        size_t column = 0;
+        while (column < COLUMNS && first_bit(column + 1) <= 32 * words) {
+            column++;
+        }
+        return column;
+    }
+
+    // Columns decided by the first key word
+    static constexpr size_t PREFIX_COLUMNS = prefix_columns(1);
+
+    // Store column `column` in the key words, which must be zero where it goes
+    template<size_t column>
+    static inline void encode(Column<column> value, uint32_t *words) {
+        constexpr size_t width = KeyNormalizer<Column<column>>::BITS;
+        uint64_t bits = KeyNormalizer<Column<column>>::encode(value);
+        // Loops over constants, which the compiler unrolls into shifts
+        for (size_t bit=first_bit(column), left=width; left>0;) {
+            size_t take = (32 - bit % 32 < left)? 32 - bit % 32: left;
+            uint32_t part = (uint32_t) (bits >> (left - take)) & (uint32_t) ((1ull << take) - 1);
+            words[bit / 32] |= part << (32 - bit % 32 - take);
+            bit += take;
+            left -= take;
+        }
+    }
+
+    template<size_t column>
+    static inline Column<column> decode(const uint32_t *words) {
+        constexpr size_t width = KeyNormalizer<Column<column>>::BITS;
+        uint64_t bits = 0;
+        for (size_t bit=first_bit(column), left=width; left>0;) {
+            size_t take = (32 - bit % 32 < left)? 32 - bit % 32: left;
+            uint64_t part = (words[bit / 32] >> (32 - bit % 32 - take)) & ((1ull << take) - 1);
+            bits = (bits << take) | part;
+            bit += take;
+            left -= take;
+        }
+        return KeyNormalizer<Column<column>>::decode(bits);
+    }
+};
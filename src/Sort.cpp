@@ -1,7 +1,8 @@
 #include "Sort.h"
 
-SortPlan::SortPlan (char const * const name, Plan * const input)
-	: Plan (name), _input (input)
+SortPlan::SortPlan (char const * const name, Plan * const input,
+		SorterConfig const & config)
+	: Plan (name), _input (input), _config (config)
 {
 	TRACE (TRACE_VAL);
 } // SortPlan::SortPlan
@@ -23,7 +24,9 @@ SortIterator::SortIterator (SortPlan const * const plan) :
 	_consumed (0), _produced (0)
 {
 	TRACE (TRACE_VAL);
-	sorter = std::make_unique<Sorter>();
+	// Rows of the plan carry no payload, so the payloads of a key/pointer sort go through Sorter directly
+	FinalAssert (_plan->_config.payload_size == 0);
+	sorter = std::make_unique<Sorter>(_plan->_config);
 	for (Row row;  _input->next (row);  _input->free (row)) {
 		sorter->add_record(&row);
 		++ _consumed;
@@ -31,9 +34,10 @@ SortIterator::SortIterator (SortPlan const * const plan) :
 	delete _input;
 	sorter->sort_contents();
 
-	traceprintf ("%s consumed %lu rows\n",
+	traceprintf ("%s consumed %lu rows (%s)\n",
 			_plan->_name,
-			(unsigned long) (_consumed));
+			(unsigned long) (_consumed),
+			sorter->get_config ().to_string ().c_str ());
 } // SortIterator::SortIterator
 
 SortIterator::~SortIterator ()
@@ -44,6 +48,16 @@ SortIterator::~SortIterator ()
 			_plan->_name,
 			(unsigned long) (_produced),
 			(unsigned long) (_consumed));
+	for (auto & report : sorter->get_plan_reports ())
+		traceprintf ("%s merge plan: %s\n",
+				_plan->_name,
+				report->to_string ().c_str ());
+	traceprintf ("%s memory broker: %s\n",
+			_plan->_name,
+			sorter->get_config ().memory_broker->to_string ().c_str ());
+	traceprintf ("%s run buffers: %s\n",
+			_plan->_name,
+			AllocPool::to_string ().c_str ());
 } // SortIterator::~SortIterator
 
 bool SortIterator::next (Row & row)
@@ -5,11 +5,13 @@ class SortPlan : public Plan
 {
 	friend class SortIterator;
 public:
-	SortPlan (char const * const name, Plan * const input);
+	SortPlan (char const * const name, Plan * const input,
+			SorterConfig const & config = SorterConfig ());
 	~SortPlan ();
 	Iterator * init () const;
 private:
 	Plan * const _input;
+	SorterConfig const _config;
 }; // class SortPlan
 
 class SortIterator : public Iterator
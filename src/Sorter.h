@@ -1,74 +1,532 @@
 #pragma once
 
+#include "defs.h"
 #include "Record.h"
 #include "Alloc.h"
+#include "SpillFile.h"
+#include "Forecaster.h"
+#include "SorterConfig.h"
+#include "Tree.h"
+#include "ThreadPool.h"
+#include "MergeScheduler.h"
+#include "Planner.h"
+#include "PayloadStore.h"
+#include "RunSort.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <vector>
 #include <boost/align/aligned_allocator.hpp>
 
 
 // Class representing a run of size 1. This is used for implementing internal sort using tournament trees
+template<typename RowSchema>
 class SingleElementRun {
 public:
-    SingleElementRun(Row* d): d(d) {
+    typedef BasicRow<RowSchema> RowType;
+
+    SingleElementRun(RowType* d): d(d) {
         read_called = false;
     } 
 
-    Row read_next() {
+    RowType& read_next() {
         if (!read_called) {
             read_called = true;
             return (*d);
         }
-        return Row::inf();
+        return inf_row;
+    }
+
+    void read_batch(RowType *&begin, RowType *&end) {
+        begin = end = d;
+        if (!read_called) {
+            read_called = true;
+            end++;
+        }
     }
     
 private:
     bool read_called;
 
-    Row* d;
+    RowType* d;
+
+    RowType inf_row {RowType::inf()};
     
 };
 
+// Class representing a run of rows sorted in place, which are returned as a single batch. Used for the leaves of the
+// internal sort when blocks are presorted
+template<typename RowSchema>
+class SortedBlockRun {
+public:
+    typedef BasicRow<RowSchema> RowType;
+
+    SortedBlockRun(RowType *begin, RowType *end): begin(begin), end(end) {}
+
+    void read_batch(RowType *&batch_begin, RowType *&batch_end) {
+        batch_begin = begin;
+        batch_end = end;
+        begin = end;
+    }
+
+private:
+    RowType *begin;
+
+    RowType *end;
+};
+
 /**
- * Base class to represent a node in the merge tree for external sorting
+ * Base class to represent a node in the merge tree for external sorting of rows with the key columns of `RowSchema`
  */
-class SortNode {
+template<typename RowSchema>
+class BasicSortNode {
 public:
-    SortNode() = default;
+    typedef BasicRow<RowSchema> RowType;
+
+    typedef BasicForecaster<RowSchema> Forecaster;
+
+    BasicSortNode() = default;
 
-    virtual ~SortNode() = default;
+    virtual ~BasicSortNode() = default;
 
     // Read next record
-    virtual Row& read_next() = 0;
+    virtual RowType& read_next() = 0;
 
     virtual bool is_internal_node() = 0;
 
     virtual size_t get_size() = 0;
+
+    // Let the merge that consumes this node schedule its disk reads. Nodes that are not read from disk ignore it
+    virtual void attach_forecaster(const std::shared_ptr<Forecaster> &) {}
+
+    /**
+     * Return the next rows in sorted order as the span [begin, end), which is empty once the node is exhausted. The
+     * rows stay valid until the next call. Merges read their inputs this way, so that the virtual call and the bounds
+     * check are paid once per span rather than once per row
+     */
+    virtual void read_batch(RowType *&begin, RowType *&end) {
+        RowType &row = read_next();
+        begin = end = &row;
+        if (!row.is_inf()) {
+            end++;
+        }
+    }
+
+    // All the rows in sorted order if they are in memory, nullptr otherwise
+    virtual RowType* get_rows() {
+        return nullptr;
+    }
+
+    // Whether the rows are read from disk
+    virtual bool is_spilled() {
+        return false;
+    }
+
+    // File holding the rows if they are read from disk and none have been read yet, nullptr otherwise
+    virtual std::shared_ptr<SpillFile> get_spill_file() {
+        return nullptr;
+    }
 };
 
+typedef BasicSortNode<SortSchema> SortNode;
+
+
+/**
+ * Class to read a range of rows of a sorted run in memory. The first row is re-coded relative to negative infinity,
+ * so that the range can be merged like a run of its own
+ */
+template<typename RowSchema>
+class BasicRowRangeNode: public BasicSortNode<RowSchema> {
+    typedef BasicSortNode<RowSchema> SortNode;
+
+public:
+    typedef BasicRow<RowSchema> RowType;
+
+    BasicRowRangeNode(RowType *begin, RowType *end): SortNode(), next(begin), end(end) {
+        size = (end - begin) * sizeof(RowType);
+        if (begin < end) {
+            begin->reset_ovc();
+        }
+        inf_row = std::move(RowType::inf());
+    }
+
+    RowType& read_next() override {
+        if (next == end) return inf_row;
+        return *(next++);
+    }
+
+    void read_batch(RowType *&begin, RowType *&end) override {
+        begin = next;
+        end = this->end;
+        next = this->end;
+    }
+
+    bool is_internal_node() override {
+        return false;
+    }
+
+    size_t get_size() override {
+        return size;
+    }
+
+private:
+    RowType *next;
+
+    RowType *end;
+
+    size_t size;
+
+    RowType inf_row;
+};
+
+typedef BasicRowRangeNode<SortSchema> RowRangeNode;
+
+template<typename RowSchema>
+class BasicReaderNode;
+
 
 /**
  * Class to merge sorted input runs. These are non-leaf nodes in the plan for external merge sort
  */
-class MergeNode : public SortNode {
+template<typename RowSchema>
+class BasicMergeNode : public BasicSortNode<RowSchema> {
+    typedef BasicSortNode<RowSchema> SortNode;
+
+    typedef BasicMergeNode<RowSchema> MergeNode;
+
+    typedef BasicReaderNode<RowSchema> ReaderNode;
+
+    typedef BasicRowRangeNode<RowSchema> RowRangeNode;
+
+    typedef BasicForecaster<RowSchema> Forecaster;
+
 public:
-    MergeNode(std::vector<std::shared_ptr<SortNode>> &input_nodes);
+    typedef BasicRow<RowSchema> RowType;
+
+    BasicMergeNode(std::vector<std::shared_ptr<SortNode>> &input_nodes)
+            : SortNode() {
+        this->inputs = std::move(input_nodes);
+        inf_row = std::move(RowType::inf());
+        size = 0;
+        for (auto& input: inputs) {
+            size += input->get_size();
+        }
+    }
+
+    ~BasicMergeNode() = default;
+
+    RowType& read_next() override {
+        if (output_reader != nullptr) return output_reader->read_next();
+        if (streaming) {
+            if (stream_offset == stream_buffer->get_size()) {
+                fill_stream_buffer();
+                if (stream_buffer->get_size() == 0) return inf_row;
+            }
+            RowType& ret_val = *(stream_buffer->read_record<RowType>(stream_offset));
+            stream_offset += sizeof(RowType);
+            return ret_val;
+        }
+        if (read_offset >= size) return inf_row;
+
+        RowType& ret_val = *(output_alloc->read_record<RowType>(read_offset));
+        read_offset += sizeof(RowType);
+        return ret_val;
+    }
+
+    void read_batch(RowType *&begin, RowType *&end) override {
+        if (output_reader != nullptr) {
+            output_reader->read_batch(begin, end);
+            return;
+        }
+        if (streaming) {
+            if (stream_offset == stream_buffer->get_size()) {
+                fill_stream_buffer();
+            }
+            begin = stream_buffer->read_record<RowType>(stream_offset);
+            end = stream_buffer->read_record<RowType>(stream_buffer->get_size());
+            stream_offset = stream_buffer->get_size();
+            return;
+        }
+        if (read_offset >= size) {
+            begin = end = nullptr;
+            return;
+        }
+        begin = output_alloc->read_record<RowType>(read_offset);
+        end = output_alloc->read_record<RowType>(size);
+        read_offset = size;
+    }
+
+    /**
+     * Execute the sort plan in a depth-first manner. Merges that have already been done are skipped. If `interrupted`
+     * returns true before a merge is started, the execution stops and false is returned
+     */
+    bool execute(const std::function<bool()> &interrupted = nullptr) {
+        if (is_merged()) {
+            return true;
+        }
+        for (auto& input_node: inputs) {
+            if (input_node->is_internal_node()) {
+                // Recursively execute all children that are merge nodes
+                auto input_merge_node = std::static_pointer_cast<MergeNode>(input_node);
+                if (!input_merge_node->execute(interrupted)) {
+                    return false;
+                }
+            }
+        }
+        if (interrupted && interrupted()) {
+            return false;
+        }
+        merge();
+        return true;
+    }
+
+    // Whether the output of this merge has been produced
+    bool is_merged() {
+        return output_alloc != nullptr || output_reader != nullptr;
+    }
+
+    /**
+     * Merge the inputs of this node only. All the input merge nodes must have been executed
+     */
+    void merge() {
+        if (spill_output) {
+            output_file = SpillFile::create(spill_directory, spill_layout);
+            FinalAssert (output_file != nullptr);
+        } else {
+            // Setup memory for output of this run
+            output_alloc = Alloc::create(size, prefault_output);
+        }
+        // Spilled inputs share a single read-ahead buffer
+        auto forecaster = std::make_shared<Forecaster>(read_block_size);
+        for (auto& input_node: inputs) {
+            input_node->attach_forecaster(forecaster);
+        }
+        forecaster->start();
+        forecaster = nullptr;
 
-    ~MergeNode() = default;
+        // Create tournament tree. Merge is complete when the tree runs out of records
+        with_tournament_tree(inputs, prefetch_distance, [this] (auto &tree) {
+            while (RowType *top_record = tree.pop()) {
+                // Write the sorted record
+                if (spill_output) {
+                    output_file->write((void*)top_record, sizeof(RowType));
+                } else if (streaming_stores) {
+                    output_alloc->write_streaming((void*)top_record, sizeof(RowType));
+                } else {
+                    output_alloc->write((void*)top_record, sizeof(RowType));
+                }
+            }
+        });
+        if (streaming_stores && !spill_output) {
+            output_alloc->finish_streaming();
+        }
+        // Inputs are fully consumed. Release their memory and files
+        report_bytes_moved(size);
+        inputs.clear();
 
-    Row& read_next() override;
+        if (spill_output) {
+            output_file->finish();
+            output_reader = std::make_shared<ReaderNode>(output_file);
+        }
+        read_offset = 0ll;
+    }
 
     /**
-     * Execute the sort plan in a depth-first manner
+     * Merge the inputs of this node on `num_slices` threads of the pool. Splitter keys divide the key space into
+     * slices of about the same size; the start of each slice in every input is found by binary search, and each
+     * thread merges one slice into its own part of the output. Falls back to merge() if an input is not in memory
+     * or the output is spilled
      */
-    void execute();
+    void merge_in_parallel(ThreadPool &pool, size_t num_slices) {
+        size_t num_rows = size / sizeof(RowType);
+        std::vector<RowType*> runs;
+        std::vector<size_t> run_rows;
+        for (auto& input_node: inputs) {
+            runs.push_back(input_node->get_rows());
+            run_rows.push_back(input_node->get_size() / sizeof(RowType));
+            if (runs.back() == nullptr) {
+                break;
+            }
+        }
+        if (spill_output || num_slices < 2 || num_rows < num_slices * MIN_ROWS_PER_SLICE
+                || std::find(runs.begin(), runs.end(), nullptr) != runs.end()) {
+            merge();
+            return;
+        }
+
+        // Pick splitters from evenly spaced samples of every run, weighted by the size of the run
+        std::vector<RowType> samples;
+        for (size_t r=0; r<runs.size(); r++) {
+            size_t num_samples = (SAMPLES_PER_SLICE * num_slices * run_rows[r] + num_rows - 1) / num_rows;
+            for (size_t i=0; i<num_samples; i++) {
+                samples.push_back(runs[r][(2*i + 1) * run_rows[r] / (2*num_samples)]);
+            }
+        }
+        auto key_less = [](const RowType &a, const RowType &b) {
+            return a.key_less(b);
+        };
+        std::sort(samples.begin(), samples.end(), key_less);
+
+        // bounds[j][r] is the first row of run r that belongs to slice j. Rows equal to a splitter go to the right
+        std::vector<std::vector<size_t>> bounds(num_slices + 1, std::vector<size_t>(runs.size(), 0));
+        bounds[num_slices] = run_rows;
+        for (size_t j=1; j<num_slices; j++) {
+            const RowType &splitter = samples[j * samples.size() / num_slices];
+            for (size_t r=0; r<runs.size(); r++) {
+                bounds[j][r] = std::lower_bound(runs[r], runs[r] + run_rows[r], splitter, key_less) - runs[r];
+            }
+        }
+
+        output_alloc = Alloc::create(size, prefault_output);
+        output_alloc->set_size(size);
+        RowType *output = output_alloc->read_record<RowType>(0);
+        std::vector<size_t> slice_starts;
+        for (size_t j=0; j<num_slices; j++) {
+            size_t slice_start = 0;
+            std::vector<std::shared_ptr<SortNode>> ranges;
+            for (size_t r=0; r<runs.size(); r++) {
+                slice_start += bounds[j][r];
+                if (bounds[j][r] < bounds[j+1][r]) {
+                    ranges.push_back(std::make_shared<RowRangeNode>(runs[r] + bounds[j][r], runs[r] + bounds[j+1][r]));
+                }
+            }
+            slice_starts.push_back(slice_start);
+            size_t prefetch = prefetch_distance;
+            pool.submit([ranges, output, slice_start, prefetch] () mutable {
+                merge_ranges(ranges, output + slice_start, prefetch);
+            });
+        }
+        pool.wait_idle();
+
+        // Each slice starts with a row coded relative to negative infinity. Code it relative to the end of the
+        // previous slice instead
+        for (auto slice_start: slice_starts) {
+            if (slice_start > 0 && slice_start < num_rows) {
+                output[slice_start].code_relative_to(output[slice_start - 1]);
+            }
+        }
+        report_bytes_moved(size);
+        inputs.clear();
+        read_offset = 0ll;
+    }
+
+    /**
+     * Produce the merged output on demand from read_next() instead of materializing it. Input merges that spill their
+     * output are executed first, the other input merges are streamed as well
+     */
+    void start_streaming() {
+        if (spill_output) {
+            execute();
+            return;
+        }
+        for (auto& input_node: inputs) {
+            if (input_node->is_internal_node()) {
+                auto input_merge_node = std::static_pointer_cast<MergeNode>(input_node);
+                input_merge_node->start_streaming();
+            }
+        }
+        auto forecaster = std::make_shared<Forecaster>(read_block_size);
+        for (auto& input_node: inputs) {
+            input_node->attach_forecaster(forecaster);
+        }
+        forecaster->start();
+        forecaster = nullptr;
+
+        stream_tree = std::make_unique<TournamentTree<SortNode>>(inputs, prefetch_distance);
+        stream_buffer = Alloc::create(STREAM_BUFFER_SIZE);
+        stream_offset = 0;
+        streaming = true;
+    }
+
+    // Bytes of memory that the merge allocates for its output
+    size_t get_output_memory() {
+        // Blocks of the spilled inputs and the forecast block, all of the block size of the forecaster
+        size_t block_memory = Forecaster::get_buffer_memory(read_block_size);
+        size_t memory = 0;
+        for (auto& input_node: inputs) {
+            if (input_node->is_spilled()) {
+                memory += (memory? 1: 2) * block_memory;
+            }
+        }
+        if (spill_output) {
+            // Only the write-behind buffers of the file
+            return memory + 2 * Alloc::get_mapped_size(SpillFile::BLOCK_SIZE);
+        }
+        return memory + Alloc::get_mapped_size(size);
+    }
+
+    RowType* get_rows() override {
+        if (output_reader != nullptr || output_alloc == nullptr) {
+            return nullptr;
+        }
+        return output_alloc->read_record<RowType>(0);
+    }
+
+    bool is_spilled() override {
+        return spill_output;
+    }
+
+    std::shared_ptr<SpillFile> get_spill_file() override {
+        return (output_reader != nullptr)? output_reader->get_spill_file(): nullptr;
+    }
+
+    // Size of the blocks read from each spilled input
+    void set_read_block_size(size_t block_size) {
+        read_block_size = block_size;
+    }
+
+    // Fault in the pages of the output buffer when it is allocated
+    void set_prefault_output(bool prefault) {
+        prefault_output = prefault;
+    }
+
+    // Prefetch the inputs of the merge this many cache lines ahead of their read positions, and the tree path of the
+    // next winner. 0 leaves it to the hardware prefetcher
+    void set_prefetch_distance(size_t lines) {
+        prefetch_distance = lines;
+    }
+
+    // Write the output in memory with non-temporal stores
+    void set_streaming_stores(bool streaming) {
+        streaming_stores = streaming;
+    }
+
+    // Report of the plan that the bytes moved by this merge are added to
+    void set_report(const std::shared_ptr<PlanReport> &report) {
+        this->report = report;
+    }
+
+    /**
+     * Write the output of this merge to a temporary file in the given directory instead of keeping it in memory
+     */
+    void spill_to(const std::string &directory, const SpillLayout &layout = SpillLayout()) {
+        spill_output = true;
+        spill_directory = directory;
+        spill_layout = layout;
+    }
+
+    std::shared_ptr<SpillFile>& get_output_file() {
+        return output_file;
+    }
 
     bool is_internal_node() override {
         return true;
     }
 
-    size_t get_size() override;
+    size_t get_size() override {
+        return size;
+    }
+
+    void attach_forecaster(const std::shared_ptr<Forecaster> &forecaster) override {
+        if (output_reader != nullptr) {
+            output_reader->attach_forecaster(forecaster);
+        }
+    }
 
     std::vector<std::shared_ptr<SortNode>> inputs;
 private:
@@ -76,27 +534,197 @@ private:
 
     std::shared_ptr<Alloc> output_alloc;
 
+    // Set if the output is written to disk
+    bool spill_output {false};
+
+    std::string spill_directory;
+
+    SpillLayout spill_layout;
+
+    size_t read_block_size {SpillFile::BLOCK_SIZE};
+
+    bool prefault_output {false};
+
+    bool streaming_stores {false};
+
+    size_t prefetch_distance {0};
+
+    std::shared_ptr<PlanReport> report {nullptr};
+
+    std::shared_ptr<SpillFile> output_file {nullptr};
+
+    // Reads back the spilled output
+    std::shared_ptr<SortNode> output_reader {nullptr};
+
+    // Set while the output is streamed. Released once the inputs are exhausted
+    std::unique_ptr<TournamentTree<SortNode>> stream_tree {nullptr};
+
+    bool streaming {false};
+
+    // Rows popped from the tree in one go, so that the tree stays in cache while the buffer is filled
+    std::shared_ptr<Alloc> stream_buffer {nullptr};
+
+    size_t stream_offset;
+
+    static const size_t STREAM_BUFFER_SIZE = 1 << 14;
+
+    void fill_stream_buffer() {
+        stream_buffer->clear();
+        stream_offset = 0;
+        if (stream_tree == nullptr) {
+            return;
+        }
+        while (stream_buffer->can_write(sizeof(RowType))) {
+            RowType *top_record = stream_tree->pop();
+            if (top_record == nullptr) {
+                // Inputs are fully consumed. Release their memory and files
+                stream_tree = nullptr;
+                report_bytes_moved(0);
+                inputs.clear();
+                return;
+            }
+            stream_buffer->write((void*)top_record, sizeof(RowType));
+        }
+    }
+
+    // Add the bytes moved by the merge to the report. `output_bytes` is the part written to the output
+    void report_bytes_moved(size_t output_bytes) {
+        if (report == nullptr) {
+            return;
+        }
+        size_t disk_bytes = spill_output? output_bytes: 0;
+        for (auto& input_node: inputs) {
+            if (input_node->is_spilled()) {
+                disk_bytes += input_node->get_size();
+            }
+        }
+        report->actual_bytes += size + output_bytes;
+        report->actual_disk_bytes += disk_bytes;
+    }
+
     size_t read_offset;
 
-    Row inf_row;
+    RowType inf_row;
+
+    // Splitter candidates taken from every input per slice of a parallel merge
+    static const size_t SAMPLES_PER_SLICE = 16;
+
+    // Merges with fewer rows per slice are not worth splitting
+    static const size_t MIN_ROWS_PER_SLICE = 1 << 12;
+
+    // Merge the row ranges into the output. The output is written with memcpy since it holds no rows yet
+    static void merge_ranges(std::vector<std::shared_ptr<SortNode>> &ranges, RowType *output,
+                             size_t prefetch_distance) {
+        if (ranges.empty()) {
+            return;
+        }
+        with_tournament_tree(ranges, prefetch_distance, [&output] (auto &tree) {
+            while (RowType *top_record = tree.pop()) {
+                memcpy(static_cast<void*>(output++), top_record, sizeof(RowType));
+            }
+        });
+    }
 };
 
+typedef BasicMergeNode<SortSchema> MergeNode;
+
 /**
  * Class to directly read from a sorted run. These are the leaf nodes in the plan for external merge sort
  */
-class ReaderNode: public SortNode {
+template<typename RowSchema>
+class BasicReaderNode: public BasicSortNode<RowSchema> {
+    friend class BasicForecaster<RowSchema>;
+
+    typedef BasicSortNode<RowSchema> SortNode;
+
+    typedef BasicForecaster<RowSchema> Forecaster;
+
 public:
-    ReaderNode(std::shared_ptr<Alloc> &input);
+    typedef BasicRow<RowSchema> RowType;
 
-    ~ReaderNode() = default;
+    BasicReaderNode(std::shared_ptr<Alloc> &input):
+            SortNode(), read_offset(0ll), input(input), block_offset(0ll) {
+        size = input->get_size();
+        input->prepare_for_read();
+        inf_row = std::move(RowType::inf());
+    }
 
-    Row& read_next() override;
+    // Read a spilled run one block at a time
+    BasicReaderNode(std::shared_ptr<SpillFile> &input_file):
+            SortNode(), read_offset(0ll), input_file(input_file), block_offset(0ll) {
+        size = input_file->get_size();
+        // The buffer of the current block is allocated by the first read, or when a forecaster is attached, at the
+        // block size of the forecaster
+        inf_row = std::move(RowType::inf());
+    }
+
+    ~BasicReaderNode() {
+        if (next_block_request != nullptr) {
+            // Don't release the buffer while the kernel may still write into it
+            input_file->finish_read(next_block_request, *next_block);
+        }
+    }
+
+    RowType& read_next() override {
+        if (read_offset >= size) return inf_row;
+
+        if (input_file != nullptr && (input == nullptr || read_offset - block_offset >= input->get_size())) {
+            read_block();
+        }
+        RowType& ret_val = *(input->read_record<RowType>(read_offset - block_offset));
+        read_offset += sizeof(RowType);
+        return ret_val;
+    }
+
+    void read_batch(RowType *&begin, RowType *&end) override {
+        if (read_offset >= size) {
+            begin = end = nullptr;
+            return;
+        }
+        if (input_file != nullptr && (input == nullptr || read_offset - block_offset >= input->get_size())) {
+            read_block();
+        }
+        // The rest of the current block, or of the whole run if it is in memory
+        size_t offset = read_offset - block_offset;
+        begin = input->read_record<RowType>(offset);
+        end = input->read_record<RowType>(input->get_size());
+        read_offset += input->get_size() - offset;
+    }
 
     bool is_internal_node() override {
         return false;
     }
 
-    size_t get_size() override;
+    size_t get_size() override {
+        return size;
+    }
+
+    void attach_forecaster(const std::shared_ptr<Forecaster> &forecaster) override {
+        if (input_file == nullptr) {
+            return;
+        }
+        this->forecaster = forecaster;
+        if (input == nullptr || input->get_capacity() < forecaster->get_block_size()) {
+            // Blocks are exchanged with the prefetch buffer of the forecaster, so they must all be able to hold a block
+            input = Alloc::create(forecaster->get_block_size());
+        }
+        forecaster->add_input(this);
+    }
+
+    RowType* get_rows() override {
+        if (input_file != nullptr) {
+            return nullptr;
+        }
+        return input->read_record<RowType>(0);
+    }
+
+    bool is_spilled() override {
+        return input_file != nullptr;
+    }
+
+    std::shared_ptr<SpillFile> get_spill_file() override {
+        return (read_offset == 0)? input_file: nullptr;
+    }
 private:
     size_t size;
 
@@ -104,57 +732,751 @@ private:
 
     std::shared_ptr<Alloc> input {nullptr};
 
-    Row inf_row;
+    std::shared_ptr<SpillFile> input_file {nullptr};
+
+    // Offset of the block currently held in `input` when reading from a file
+    size_t block_offset;
+
+    // The block after the current one is read in the background while the current one is merged
+    std::shared_ptr<Alloc> next_block {nullptr};
+
+    std::shared_ptr<IORequest> next_block_request {nullptr};
+
+    // If set, blocks are read by the forecaster of the merge instead of being double-buffered
+    std::shared_ptr<Forecaster> forecaster {nullptr};
+
+    RowType inf_row;
+
+    // Blocks read without a forecaster, in whole rows
+    static const size_t READ_BLOCK_SIZE = SpillFile::BLOCK_SIZE / sizeof(RowType) * sizeof(RowType);
+
+    void read_block() {
+        if (forecaster != nullptr) {
+            forecaster->refill(*this);
+            return;
+        }
+        block_offset = read_offset;
+        if (next_block_request == nullptr) {
+            // First read from the file
+            if (next_block == nullptr) {
+                next_block = Alloc::create(READ_BLOCK_SIZE);
+            }
+            next_block_request = input_file->start_read(block_offset, *next_block, READ_BLOCK_SIZE);
+        }
+        input_file->finish_read(next_block_request, *next_block);
+        std::swap(input, next_block);
+        next_block_request = nullptr;
+
+        // Read ahead the following block
+        size_t next_offset = block_offset + input->get_size();
+        if (next_offset < size) {
+            if (next_block == nullptr) {
+                // The second buffer is only needed by runs of more than one block
+                next_block = Alloc::create(READ_BLOCK_SIZE);
+            }
+            next_block_request = input_file->start_read(next_offset, *next_block, READ_BLOCK_SIZE);
+        }
+    }
 };
 
+typedef BasicReaderNode<SortSchema> ReaderNode;
+
 
 /**
- * Class responsible for coordinating the sort operation
+ * Class responsible for coordinating the sort operation on rows with the key columns of `RowSchema`
  */
-class Sorter {
+template<typename RowSchema>
+class BasicSorter {
+    typedef BasicSortNode<RowSchema> SortNode;
+
+    typedef BasicMergeNode<RowSchema> MergeNode;
+
+    typedef BasicReaderNode<RowSchema> ReaderNode;
+
+    typedef BasicMergePlanner<RowSchema> MergePlanner;
+
 public:
-    Sorter();
+    typedef BasicRow<RowSchema> RowType;
+
+    /**
+     * Sorted runs are kept in memory until they use up the memory budget, after which they are merged and written
+     * to a temporary file in the spill directory. Unset fields of the config are chosen for the current machine
+     */
+    BasicSorter(const SorterConfig &config = SorterConfig()): config(config.resolve_for<BasicSorter>()),
+            memory_used(0) {
+        memory_grant = this->config.memory_broker->admit(
+            min(MIN_MEMORY_GRANT, this->config.memory_budget), this->config.memory_budget, this->config.priority,
+            [this] (size_t memory_budget) {
+                requested_memory_budget = memory_budget;
+            });
+        memory_budget = memory_grant->get_size();
+        requested_memory_budget = memory_budget;
+        requested_maximum = this->config.memory_budget;
+        current_alloc = Alloc::create(this->config.run_size);
+        input_size = 1;
+        if (this->config.replacement_selection) {
+            // The tree takes half of the memory the sort is admitted with, and the runs it writes the other half until
+            // more is granted. Its rows are charged to the budget like the runs
+            size_t capacity = memory_budget / 2 / sizeof(BasicTournamentTreeNode<RowType>);
+            selection_tree = std::make_unique<BasicReplacementSelectionTree<RowType>>(capacity);
+            selection_memory = selection_tree->get_capacity() * sizeof(BasicTournamentTreeNode<RowType>);
+            memory_used = selection_memory;
+        } else if (this->config.run_threads > 1) {
+            run_pool = std::make_unique<ThreadPool>(this->config.run_threads, true);
+        }
+        if (this->config.merge_threads > 1) {
+            merge_scheduler = std::make_unique<MergeScheduler>(this->config.merge_threads, memory_budget);
+        }
+        if (this->config.payload_size > 0) {
+            // The row id of a payload is kept in the storage word after the key
+            FinalAssert (RowType::HAS_ROW_ID);
+            payloads = std::make_unique<PayloadStore>(this->config.payload_size, this->config.spill_directory);
+            gathered_rows.resize(GATHER_BATCH);
+            gathered_payloads.resize(GATHER_BATCH * this->config.payload_size);
+        }
+    }
 
     /**
      * Add a single record to the Sorter
      */
-    void add_record(Row *record);
+    void add_record(RowType *record) {
+        if (memory_budget_changed()) {
+            resize_run_generation();
+        }
+        if (selection_tree != nullptr) {
+            if (selection_tree->fill(*record)) {
+                // Still filling the tree
+                return;
+            }
+            output_top();
+            selection_tree->replace_top(*record);
+            return;
+        }
+        if (current_alloc->can_write(sizeof(RowType))) {
+            // If the current run has space, write the new record to it
+            current_alloc->write(static_cast<void*>(record), sizeof(RowType));
+            return;
+        }
+        if (run_pool != nullptr) {
+            // The run is sorted in the cache of another core, so there is no cache tier to manage here
+            submit_current_run();
+            current_alloc = Alloc::create(config.run_size);
+            current_alloc->write(static_cast<void*>(record), sizeof(RowType));
+            input_size++;
+            return;
+        }
+        current_alloc = std::move(sort_current_run());
+        if (is_cache_filled()) {
+            // Cache is full. Spill to memory
+            current_alloc->flush();        
+        } else {
+            cached_allocs.push_back(current_alloc);
+        }
+        memory_used += current_alloc->get_capacity();
+        all_allocs.push_back(std::move(current_alloc));
+        if (!grow_memory_budget(memory_used + config.run_size)) {
+            // Memory budget is used up. Spill to disk
+            spill_runs();
+        }
+        current_alloc = Alloc::create(config.run_size);
+        current_alloc->write(static_cast<void*>(record), sizeof(RowType));
+        input_size++;
+    }
 
     /**
-     * Return next record in sorted order
+     * Add a record with a payload of SorterConfig::payload_size bytes. The payload is copied into a store of its own
+     * and the record only carries its row id, so the payload is not moved by the sort. When the config has a payload
+     * size, all the records must be added this way
      */
-    Row& get_next_record();
+    void add_record(RowType *record, const void *payload) {
+        FinalAssert (payloads != nullptr);
+        if constexpr (RowType::HAS_ROW_ID) {
+            // Payloads are charged against the budget here, whichever way the runs are generated. When a new chunk
+            // does not fit next to the runs in memory, the full chunks are spilled, which is cheaper than spilling
+            // runs: every payload is written once and never read back by a merge
+            size_t chunk_size = payloads->get_next_chunk_size();
+            if (chunk_size > 0 && !grow_memory_budget(memory_used + payloads->get_memory_size() + chunk_size)) {
+                payloads->spill();
+            }
+            RowType key = *record;
+            key.set_row_id(payloads->append(payload));
+            add_record(&key);
+        }
+    }
+
+    /**
+     * Return next record in sorted order. With payloads, the output is taken a batch at a time ahead of the records
+     * returned, so it must not be read in any other way
+     */
+    RowType& get_next_record() {
+        if (payloads == nullptr) {
+            return output_node->read_next();
+        }
+        if (gathered_next == gathered_count) {
+            gather_batch();
+            if (gathered_count == 0) {
+                return inf_row;
+            }
+        }
+        return gathered_rows[gathered_next++];
+    }
+
+    // Payload of the record last returned by get_next_record(), which stays valid until the next call. nullptr before
+    // the first record and after the last one
+    inline const void* get_payload() {
+        if (gathered_next == 0) {
+            return nullptr;
+        }
+        return gathered_payloads.data() + (gathered_next - 1) * config.payload_size;
+    }
 
     /**
      * Sort all records. This is called after all records have been added
      */
-    void sort_contents();
+    void sort_contents() {
+        wait_for_runs();
+        if (selection_tree != nullptr) {
+            selection_tree->initialize();
+            while (!selection_tree->empty()) {
+                output_top();
+                selection_tree->pop_top();
+            }
+            finish_run();
+            selection_tree = nullptr;
+            memory_used -= selection_memory;
+            selection_memory = 0;
+        }
+        if (current_alloc->get_size()) {
+            current_alloc = std::move(sort_current_run());
+            all_allocs.push_back(current_alloc);
+        }
+        std::vector<std::shared_ptr<SortNode>> runs;
+        if (all_allocs.empty() && spilled_runs.empty()) {
+            // No input rows. Read from the empty run
+            all_allocs.push_back(current_alloc);
+        }
+        for (auto& file: spilled_runs) {
+            runs.push_back(std::make_shared<ReaderNode>(file));
+        }
+        for (auto& alloc: all_allocs) {
+            runs.push_back(std::make_shared<ReaderNode>(alloc));
+        }
+        all_allocs.clear();
+        cached_allocs.clear();
+        current_alloc = nullptr;
+        if (runs.size() == 1) {
+            // All the rows fit in a single run
+            output_node = std::move(runs[0]);
+            return;
+        }
+        // Merges in memory hold their inputs and their output at the same time
+        size_t total_size = 0;
+        for (auto& run: runs) {
+            total_size += run->get_size();
+        }
+        grow_memory_budget(2 * total_size);
+        // Create merge plan
+        auto root_node = plan(runs);
+        if (config.streaming_merge) {
+            // Rows are merged as they are read. Only the merges that are executed up front are timed
+            auto start = std::chrono::steady_clock::now();
+            root_node->start_streaming();
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            plan_reports.back()->actual_seconds += duration.count();
+            output_node = std::move(root_node);
+            return;
+        }
+        if (merge_scheduler == nullptr) {
+            output_node = execute_plan(root_node, false);
+            return;
+        }
+        // The final merge is the serial tail of the sort, so it is split across all the merge threads as well
+        root_node = execute_plan(root_node, false, false);
+        auto start = std::chrono::steady_clock::now();
+        ThreadPool final_merge_pool {config.merge_threads, true};
+        root_node->merge_in_parallel(final_merge_pool, config.merge_threads);
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        plan_reports.back()->actual_seconds += duration.count();
+        output_node = std::move(root_node);
+    }
+
+    const SorterConfig& get_config() {
+        return config;
+    }
+
+    /**
+     * Change the memory budget of the sort. This may be called from any thread. The change takes effect the next time
+     * a record is added, or before the next merge is started. It sets the maximum of the grant of the memory broker,
+     * which shrinks the grant right away or grows it as far as the free memory of the broker allows. The broker
+     * resizes the budget the same way. When the budget shrinks, runs in memory are spilled and
+     * merges are planned with a smaller fan-in. When it grows, spilled runs are read back into memory and merges are
+     * planned with a larger fan-in
+     */
+    void set_memory_budget(size_t memory_budget) {
+        requested_maximum = memory_budget;
+        memory_grant->set_maximum(memory_budget);
+    }
+
+    // Plans that have been executed so far, in order. The last one is the final merge
+    const std::vector<std::shared_ptr<PlanReport>>& get_plan_reports() {
+        return plan_reports;
+    }
 
 private:
-    const static size_t CACHE_SIZE = 65536;
+    SorterConfig config;
+
+    size_t input_size; // in runs
+
+    // Bytes held by the sorted runs in memory, and by the replacement selection tree
+    size_t memory_used;
 
-    const static size_t F = 65536/4096;     // Cache size / page size
+    // Memory granted by the broker that the sort keeps to. config.memory_budget is the most it may ask for
+    size_t memory_budget;
 
-    size_t input_size; // in pages
+    // Grant set by the broker that has not been applied to memory_budget yet
+    std::atomic<size_t> requested_memory_budget;
+
+    // Maximum set by set_memory_budget() that has not been applied to the config yet
+    std::atomic<size_t> requested_maximum;
 
     std::shared_ptr<Alloc> current_alloc;
 
+    // Buffer of run size that the radix sort of a run is done in. Swapped with the run if the sorted rows end up here
+    std::shared_ptr<Alloc> scratch_alloc {nullptr};
+
     std::vector<std::shared_ptr<Alloc>> all_allocs;
 
     // Runs currently in CPU cache
     std::vector<std::shared_ptr<Alloc>> cached_allocs;
 
+    // Runs that have been written to disk
+    std::vector<std::shared_ptr<SpillFile>> spilled_runs;
+
+    // Resident tree if runs are generated by replacement selection
+    std::unique_ptr<BasicReplacementSelectionTree<RowType>> selection_tree {nullptr};
+
+    // Bytes of memory_used that are held by the replacement selection tree
+    size_t selection_memory {0};
+
+    // File that the current run is written to by replacement selection once it has outgrown the memory budget
+    std::shared_ptr<SpillFile> current_run_file {nullptr};
+
     std::shared_ptr<SortNode> output_node {nullptr};
 
+    std::vector<std::shared_ptr<PlanReport>> plan_reports;
+
+    // Set if the records have payloads
+    std::unique_ptr<PayloadStore> payloads {nullptr};
+
+    // Records taken from the output together with their payloads, which are returned one at a time
+    std::vector<RowType> gathered_rows;
+
+    std::vector<char> gathered_payloads;
+
+    size_t gathered_next {0};
+
+    size_t gathered_count {0};
+
+    // Rest of the last span read from the output
+    RowType *output_begin {nullptr};
+
+    RowType *output_end {nullptr};
+
+    RowType inf_row {RowType::inf()};
+
+    // Records whose payloads are gathered at once
+    static const size_t GATHER_BATCH = 256;
+
+    // Take the next batch of records from the output and gather their payloads
+    void gather_batch() {
+        gathered_next = gathered_count = 0;
+        while (gathered_count < GATHER_BATCH) {
+            if (output_begin == output_end) {
+                output_node->read_batch(output_begin, output_end);
+                if (output_begin == output_end) {
+                    break;
+                }
+            }
+            size_t count = std::min((size_t) (output_end - output_begin), GATHER_BATCH - gathered_count);
+            std::copy(output_begin, output_begin + count, gathered_rows.begin() + gathered_count);
+            output_begin += count;
+            gathered_count += count;
+        }
+        if constexpr (RowType::HAS_ROW_ID) {
+            payloads->gather(gathered_rows.data(), gathered_count, gathered_payloads.data());
+        }
+    }
+
+    // Protects all_allocs and spare_scratch_allocs while runs are sorted in the background
+    std::mutex runs_mutex;
+
+    // Scratch buffers that are not in use by a run thread
+    std::vector<std::shared_ptr<Alloc>> spare_scratch_allocs;
+
+    // Memory granted by the broker. Declared after the budget that its resize callback writes to
+    std::unique_ptr<MemoryGrant> memory_grant {nullptr};
+
+    // Executes the merges of a plan concurrently if there is more than one merge thread
+    std::unique_ptr<MergeScheduler> merge_scheduler {nullptr};
+
+    // Declared last so that the workers are joined before anything they use is destroyed
+    std::unique_ptr<ThreadPool> run_pool {nullptr};
+
+    /**
+     * Create a merge plan over the given runs and return the root node. If `spill_root` is set, the output of the root
+     * is written to disk
+     */
+    std::shared_ptr<MergeNode> plan(std::vector<std::shared_ptr<SortNode>> &runs, bool spill_root = false) {
+        TRACE (TRACE_VAL);
+        // Merges are planned for the memory granted right now rather than the most the sort may ask for
+        SorterConfig plan_config = config;
+        plan_config.memory_budget = memory_budget;
+        MergePlanner planner {plan_config};
+        auto root_node = planner.plan(runs, spill_root);
+        plan_reports.push_back(planner.get_report());
+        return root_node;
+    }
+
+    /**
+     * Execute all the merges of a plan. If the memory budget changes in the meantime, the remaining merges are planned
+     * again for the new budget, so the root that is returned may differ from `root`. If `merge_root` is false, the
+     * merge of the root is left to the caller
+     */
+    std::shared_ptr<MergeNode> execute_plan(std::shared_ptr<MergeNode> root, bool spill_root, bool merge_root = true) {
+        auto interrupted = [this] {
+            return memory_budget_changed();
+        };
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            bool completed = (merge_scheduler != nullptr)? merge_scheduler->execute(root, merge_root, interrupted)
+                                                         : root->execute(interrupted);
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+            plan_reports.back()->actual_seconds += duration.count();
+            if (completed) {
+                return root;
+            }
+            // The budget changed between two merges. Plan the remaining merges again for the new budget
+            apply_memory_budget();
+            std::vector<std::shared_ptr<SortNode>> runs;
+            collect_runs(root, runs);
+            fit_runs_in_budget(runs);
+            root = plan(runs, spill_root);
+        }
+    }
+
+    // Add the nodes that the merges of an interrupted plan that have not been done would read
+    void collect_runs(const std::shared_ptr<SortNode> &node, std::vector<std::shared_ptr<SortNode>> &runs) {
+        if (node->is_internal_node()) {
+            auto merge_node = std::static_pointer_cast<MergeNode>(node);
+            if (!merge_node->is_merged()) {
+                for (auto& input_node: merge_node->inputs) {
+                    collect_runs(input_node, runs);
+                }
+                return;
+            }
+        }
+        runs.push_back(node);
+    }
+
+    // Spill the runs in memory or read spilled runs back until the runs in memory fit the memory budget
+    void fit_runs_in_budget(std::vector<std::shared_ptr<SortNode>> &runs) {
+        size_t resident = 0;
+        for (auto& run: runs) {
+            if (!run->is_spilled()) {
+                resident += run->get_size();
+            }
+        }
+        auto by_size = [&runs](size_t a, size_t b) {
+            return runs[a]->get_size() < runs[b]->get_size();
+        };
+        std::vector<size_t> order;
+        for (size_t i=0; i<runs.size(); i++) {
+            order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), by_size);
+        if (resident > memory_budget) {
+            // Spill the largest runs in memory first
+            for (auto it = order.rbegin(); it != order.rend() && resident > memory_budget; it++) {
+                auto& run = runs[*it];
+                RowType *rows = run->get_rows();
+                if (rows == nullptr) {
+                    continue;
+                }
+                auto file = SpillFile::create(config.spill_directory, config.get_spill_layout<RowType>());
+                FinalAssert (file != nullptr);
+                file->write(rows, run->get_size());
+                file->finish();
+                resident -= run->get_size();
+                run = std::make_shared<ReaderNode>(file);
+            }
+            return;
+        }
+        // Read the smallest spilled runs back while they fit
+        for (auto i: order) {
+            auto& run = runs[i];
+            auto file = run->get_spill_file();
+            if (file == nullptr) {
+                continue;
+            }
+            if (resident + run->get_size() > memory_budget) {
+                break;
+            }
+            auto alloc = load_run(*file);
+            if (alloc == nullptr) {
+                break;
+            }
+            resident += run->get_size();
+            run = std::make_shared<ReaderNode>(alloc);
+        }
+    }
+
+    // Read a spilled run into memory. Returns nullptr if the memory could not be mapped
+    std::shared_ptr<Alloc> load_run(SpillFile &file) {
+        auto alloc = Alloc::create(file.get_size(), config.prefault);
+        if (alloc != nullptr) {
+            file.read(0, alloc->get_addr(), file.get_size());
+            alloc->set_size(file.get_size());
+        }
+        return alloc;
+    }
+
+    inline bool memory_budget_changed() {
+        return requested_memory_budget.load(std::memory_order_relaxed) != memory_budget;
+    }
+
+    void apply_memory_budget() {
+        memory_budget = requested_memory_budget;
+        config.memory_budget = requested_maximum;
+        if (merge_scheduler != nullptr) {
+            merge_scheduler->set_memory_budget(memory_budget);
+        }
+    }
+
+    // Grant that a sort is admitted with. The rest is asked for as the runs fill it up
+    static const size_t MIN_MEMORY_GRANT = 1 << 18;
+
+    /**
+     * Ask the broker to raise the budget to at least `bytes`, or to twice the current budget if that is more, so that
+     * the number of requests grows with the log of the input. Returns whether `bytes` fit in the budget
+     */
+    bool grow_memory_budget(size_t bytes) {
+        if (bytes > memory_budget) {
+            memory_grant->request(max(bytes, 2 * memory_budget));
+        }
+        if (memory_budget_changed()) {
+            apply_memory_budget();
+        }
+        return bytes <= memory_budget;
+    }
+
+    // Spill the runs in memory or read spilled runs back after the budget changed during run generation
+    void resize_run_generation() {
+        // Sorted runs are only published once the run threads are done with them
+        wait_for_runs();
+        apply_memory_budget();
+        if (memory_used + config.run_size > memory_budget) {
+            if (!all_allocs.empty()) {
+                spill_runs();
+            }
+            return;
+        }
+        // Read spilled runs back while they fit
+        for (auto it = spilled_runs.begin(); it != spilled_runs.end(); ) {
+            auto& file = *it;
+            if (memory_used + file->get_size() + config.run_size > memory_budget) {
+                it++;
+                continue;
+            }
+            auto alloc = load_run(*file);
+            if (alloc == nullptr) {
+                return;
+            }
+            memory_used += alloc->get_capacity();
+            all_allocs.push_back(std::move(alloc));
+            it = spilled_runs.erase(it);
+        }
+    }
+
     /**
-     * Create a merge plan and return the root node
+     * Merge all the runs in memory into a single run on disk
      */
-    std::shared_ptr<MergeNode> plan();
+    void spill_runs() {
+        TRACE (TRACE_VAL);
+        wait_for_runs();
+        std::vector<std::shared_ptr<SortNode>> runs;
+        for (auto& alloc: all_allocs) {
+            runs.push_back(std::make_shared<ReaderNode>(alloc));
+        }
+        // The readers hold the only remaining references, so each run is freed as soon as it has been merged
+        all_allocs.clear();
+        cached_allocs.clear();
+        // Only the replacement selection tree is left in memory
+        memory_used = selection_memory;
 
-    bool is_cache_filled();
+        auto root_node = execute_plan(plan(runs, true), true);
+        spilled_runs.push_back(root_node->get_output_file());
+    }
 
-    // Perform internal sort on the cache-sized run that is currently being written to. Returns a run containing sorted output
-    std::shared_ptr<Alloc> sort_current_run();
+    bool is_cache_filled() {
+        size_t capacity = config.cache_size/config.run_size;
+        return cached_allocs.size() == capacity;
+    }
+
+    // Perform internal sort on the cache-sized run that is currently being written to. Returns a run containing sorted
+    // output
+    std::shared_ptr<Alloc> sort_current_run() {
+        return sort_run(current_alloc, scratch_alloc);
+    }
+
+    // Sort a run using `scratch` as the work area. The returned run may be the old scratch buffer, in which case
+    // `scratch` is replaced by the input run
+    std::shared_ptr<Alloc> sort_run(std::shared_ptr<Alloc> run, std::shared_ptr<Alloc> &scratch) {
+        if (config.run_sort != RunSort::RADIX) {
+            return tournament_sort_run(run);
+        }
+        if (scratch == nullptr) {
+            scratch = Alloc::create(config.run_size);
+        }
+        size_t count = run->get_size() / sizeof(RowType);
+        RowType *rows = run->read_record<RowType>(0);
+        RowType *sorted = radix_sort(rows, count, scratch->read_record<RowType>(0));
+        code_sorted_run(sorted, count);
+        if (sorted == rows) {
+            return run;
+        }
+        // Hand out the scratch buffer as the run and sort the next run in the old one
+        scratch->set_size(run->get_size());
+        std::swap(scratch, run);
+        return run;
+    }
+
+    std::shared_ptr<Alloc> tournament_sort_run(std::shared_ptr<Alloc> &run) {
+        std::shared_ptr<Alloc> output = Alloc::create(run->get_size());
+        auto merge = [&output] (auto &tree) {
+            while (RowType *top_record = tree.pop()) {
+                output->write((void*)top_record, sizeof(RowType));
+            }
+        };
+        if (config.run_sort == RunSort::BLOCK_TOURNAMENT) {
+            // Presorted blocks as the leaves take log2(SORTED_BLOCK_ROWS) levels off the tree
+            size_t count = run->get_size() / sizeof(RowType);
+            RowType *rows = run->read_record<RowType>(0);
+            sort_blocks(rows, count);
+            std::vector<std::shared_ptr<SortedBlockRun<RowSchema>>> inputs;
+            for (size_t start=0; start < count; start += SORTED_BLOCK_ROWS) {
+                RowType *end = rows + min(start + SORTED_BLOCK_ROWS, count);
+                inputs.push_back(std::make_shared<SortedBlockRun<RowSchema>>(rows + start, end));
+            }
+            with_tournament_tree(inputs, 0, merge);
+            return output;
+        }
+
+        std::vector<std::shared_ptr<SingleElementRun<RowSchema>>> inputs;
+        for (size_t offset=0; offset < run->get_size(); offset += sizeof(RowType)) {
+            auto ptr = std::make_shared<SingleElementRun<RowSchema>>(run->read_record<RowType>(offset));
+            inputs.push_back(std::move(ptr));
+        }
+        with_tournament_tree(inputs, 0, merge);
+        return output;
+    }
+
+    // Hand the full current run to the run threads
+    void submit_current_run() {
+        // The run is accounted for right away so that the memory budget also covers the runs that are being sorted
+        memory_used += current_alloc->get_capacity();
+        auto run = std::move(current_alloc);
+        run_pool->submit([this, run] {
+            std::shared_ptr<Alloc> scratch {nullptr};
+            {
+                std::lock_guard<std::mutex> lock(runs_mutex);
+                if (!spare_scratch_allocs.empty()) {
+                    scratch = std::move(spare_scratch_allocs.back());
+                    spare_scratch_allocs.pop_back();
+                }
+            }
+            auto sorted = sort_run(run, scratch);
+            std::lock_guard<std::mutex> lock(runs_mutex);
+            all_allocs.push_back(std::move(sorted));
+            if (scratch != nullptr) {
+                spare_scratch_allocs.push_back(std::move(scratch));
+            }
+        });
+        if (!grow_memory_budget(memory_used + config.run_size)) {
+            // Memory budget is used up. Spill to disk once the runs are sorted
+            spill_runs();
+        }
+    }
+
+    // Wait until the run threads have sorted all the submitted runs
+    void wait_for_runs() {
+        if (run_pool != nullptr) {
+            run_pool->wait_idle();
+        }
+    }
+
+    // Write the top row of the replacement selection tree to the current run
+    void output_top() {
+        RowType row = selection_tree->top();
+        if (selection_tree->top_starts_run()) {
+            finish_run();
+            row.reset_ovc();
+        }
+        write_to_current_run(row);
+    }
+
+    void write_to_current_run(const RowType &row) {
+        if (current_run_file != nullptr) {
+            current_run_file->write((void*)(&row), sizeof(RowType));
+            return;
+        }
+        if (!current_alloc->can_write(sizeof(RowType))) {
+            size_t new_capacity = 2 * current_alloc->get_capacity();
+            if (!grow_memory_budget(memory_used + new_capacity) && !all_allocs.empty()) {
+                // Make room by spilling the completed runs
+                spill_runs();
+            }
+            if (memory_used + new_capacity > memory_budget) {
+                // The run alone does not fit in memory. Continue writing it to disk
+                current_run_file = SpillFile::create(config.spill_directory, config.get_spill_layout<RowType>());
+                FinalAssert (current_run_file != nullptr);
+                current_run_file->write(current_alloc->get_addr(), current_alloc->get_size());
+                current_run_file->write((void*)(&row), sizeof(RowType));
+                current_alloc = Alloc::create(config.run_size);
+                return;
+            }
+            FinalAssert (current_alloc->resize(new_capacity));
+        }
+        current_alloc->write((void*)(&row), sizeof(RowType));
+    }
+
+    // Close the run written by replacement selection
+    void finish_run() {
+        if (current_run_file != nullptr) {
+            current_run_file->finish();
+            spilled_runs.push_back(std::move(current_run_file));
+            current_run_file = nullptr;
+            return;
+        }
+        if (current_alloc->get_size() == 0) {
+            return;
+        }
+        // Give back the unused part of the run
+        current_alloc->resize(current_alloc->get_size());
+        memory_used += current_alloc->get_capacity();
+        all_allocs.push_back(std::move(current_alloc));
+        current_alloc = Alloc::create(config.run_size);
+    }
 };
 
+typedef BasicSorter<SortSchema> Sorter;
+
+// The sorter for the schema it is compiled for is instantiated once, in Sorter.cpp
+extern template class BasicSortNode<SortSchema>;
+
+extern template class BasicRowRangeNode<SortSchema>;
+
+extern template class BasicMergeNode<SortSchema>;
+
+extern template class BasicReaderNode<SortSchema>;
 
+extern template class BasicSorter<SortSchema>;
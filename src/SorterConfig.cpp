@@ -0,0 +1,207 @@
+#include "SorterConfig.h"
+#include "Sorter.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Parse a size from sysfs such as "48K" or "2048K"
+static size_t parse_size(const std::string &text) {
+    size_t size = 0;
+    size_t i = 0;
+    for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; i++) {
+        size = size * 10 + (text[i] - '0');
+    }
+    if (i < text.size()) {
+        switch (text[i]) {
+            case 'K': size <<= 10; break;
+            case 'M': size <<= 20; break;
+            case 'G': size <<= 30; break;
+        }
+    }
+    return size;
+}
+
+// Size of the data (or unified) cache at the given level of cpu0, or 0 if sysfs does not describe it
+static size_t read_sysfs_cache_size(int level) {
+    for (int index = 0; ; index++) {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::ifstream level_file(dir + "level");
+        if (!level_file) {
+            return 0;
+        }
+        int cache_level = 0;
+        std::string type, size;
+        level_file >> cache_level;
+        std::ifstream(dir + "type") >> type;
+        std::ifstream(dir + "size") >> size;
+        if (cache_level == level && type != "Instruction") {
+            return parse_size(size);
+        }
+    }
+}
+
+static size_t detect_cache_size(int level, int sysconf_name, size_t fallback) {
+    size_t size = read_sysfs_cache_size(level);
+    if (size == 0) {
+        long res = sysconf(sysconf_name);
+        size = (res > 0)? res: 0;
+    }
+    return size? size: fallback;
+}
+
+const CacheInfo& CacheInfo::detect() {
+    static CacheInfo info = [] {
+        CacheInfo info;
+        info.l1_size = detect_cache_size(1, _SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+        info.l2_size = detect_cache_size(2, _SC_LEVEL2_CACHE_SIZE, 256 << 10);
+        info.l3_size = detect_cache_size(3, _SC_LEVEL3_CACHE_SIZE, 8 << 20);
+        return info;
+    } ();
+    return info;
+}
+
+// Whether a sysfs CPU list such as "0-3,8-11" contains the CPU
+static bool cpu_list_contains(const std::string &list, int cpu) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = (dash == std::string::npos)? first: std::atoi(range.c_str() + dash + 1);
+        if (cpu >= first && cpu <= last) {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+bool CacheInfo::shares_cache(int cpu_a, int cpu_b, int level) {
+    if (cpu_a == cpu_b) {
+        return true;
+    }
+    for (int index = 0; ; index++) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu_a) + "/cache/index"
+            + std::to_string(index) + "/";
+        std::ifstream level_file(dir + "level");
+        if (!level_file) {
+            return false;
+        }
+        int cache_level = 0;
+        std::string type, shared_cpus;
+        level_file >> cache_level;
+        std::ifstream(dir + "type") >> type;
+        std::ifstream(dir + "shared_cpu_list") >> shared_cpus;
+        if (cache_level == level && type != "Instruction") {
+            return cpu_list_contains(shared_cpus, cpu_b);
+        }
+    }
+}
+
+void SorterConfig::calibrate(size_t row_size, const std::function<double(const SorterConfig&)> &measure) {
+    const CacheInfo &caches = CacheInfo::detect();
+    SorterConfig candidate = *this;
+    // Everything stays in memory
+    candidate.memory_budget = 4 * CALIBRATION_ROWS * row_size;
+    if (candidate.fan_in == 0) {
+        candidate.fan_in = 16;
+    }
+
+    if (run_size == 0) {
+        // Runs between a fraction of L1 and a fraction of L2
+        std::vector<size_t> run_sizes {caches.l1_size / 4, caches.l1_size / 2, caches.l1_size,
+                                       2 * caches.l1_size, caches.l2_size / 8};
+        double best_throughput = 0;
+        size_t previous = 0;
+        std::sort(run_sizes.begin(), run_sizes.end());
+        for (auto size: run_sizes) {
+            // Whole pages of whole rows
+            size = RoundDown(max(RoundDown(size, Alloc::PAGE_SIZE), Alloc::PAGE_SIZE), row_size);
+            if (size == previous) {
+                continue;
+            }
+            previous = size;
+            candidate.run_size = size;
+            double throughput = measure(candidate);
+            if (throughput > best_throughput) {
+                best_throughput = throughput;
+                run_size = size;
+            }
+        }
+    }
+    candidate.run_size = run_size;
+
+    if (fan_in == 0) {
+        double best_throughput = 0;
+        for (size_t candidate_fan_in: {4, 8, 16, 32, 64}) {
+            candidate.fan_in = candidate_fan_in;
+            double throughput = measure(candidate);
+            if (throughput > best_throughput) {
+                best_throughput = throughput;
+                fan_in = candidate_fan_in;
+            }
+        }
+    }
+}
+
+SorterConfig SorterConfig::resolve_machine() const {
+    SorterConfig config = *this;
+    const CacheInfo &caches = CacheInfo::detect();
+    if (config.fan_in == 1) {
+        config.fan_in = 2;
+    }
+    if (config.run_threads == 0) {
+        config.run_threads = max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (config.merge_threads == 0) {
+        config.merge_threads = max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (config.streaming_store_size == 0) {
+        config.streaming_store_size = caches.l3_size;
+    }
+    if (config.cache_size == 0) {
+        config.cache_size = caches.l2_size;
+    }
+    if (config.memory_budget == 0) {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        config.memory_budget = (pages > 0 && page_size > 0)? (size_t) pages * page_size / 4: 1ull << 30;
+    }
+    if (config.memory_broker == nullptr) {
+        config.memory_broker = &MemoryBroker::global();
+    }
+    return config;
+}
+
+void SorterConfig::resolve_disk_fan_in() {
+    if (disk_fan_in == 0) {
+        disk_fan_in = max(fan_in, DEFAULT_DISK_FAN_IN);
+    } else if (disk_fan_in == 1) {
+        disk_fan_in = 2;
+    }
+}
+
+SorterConfig SorterConfig::resolve() const {
+    return resolve_for<Sorter>();
+}
+
+std::string SorterConfig::to_string() const {
+    return "run size " + std::to_string(run_size) + ", fan-in " + std::to_string(fan_in)
+        + ", disk fan-in " + std::to_string(disk_fan_in)
+        + ", cache size " + std::to_string(cache_size) + ", run threads " + std::to_string(run_threads)
+        + ", merge threads " + std::to_string(merge_threads) + ", memory budget " + std::to_string(memory_budget)
+        + (replacement_selection? ", replacement selection": "")
+        + (run_sort == RunSort::TOURNAMENT? ", tournament run sort": "")
+        + (run_sort == RunSort::BLOCK_TOURNAMENT? ", block tournament run sort": "")
+        + (streaming_merge? ", streaming merge": "")
+        + (pax_runs? ", PAX runs": "")
+        + (payload_size? ", payload size " + std::to_string(payload_size): "")
+        + (priority? ", priority " + std::to_string(priority): "");
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "defs.h"
+#include "MemoryBroker.h"
+#include "SpillFile.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Sizes of the data caches of the machine, detected from sysfs (falling back to sysconf)
+ */
+struct CacheInfo {
+    size_t l1_size;
+
+    size_t l2_size;
+
+    size_t l3_size;
+
+    // Detected once per process
+    static const CacheInfo& detect();
+
+    // Whether two CPUs share the data cache at the given level, according to sysfs
+    static bool shares_cache(int cpu_a, int cpu_b, int level);
+};
+
+/**
+ * Costs of the basic operations of a sort, used to choose the merge plan. The defaults describe a server with an SSD
+ */
+struct CostModel {
+    // Nanoseconds per row comparison in a tournament tree
+    double compare_ns {10.0};
+
+    // Nanoseconds to move a row from an input of a merge to its output, apart from the comparisons
+    double row_ns {40.0};
+
+    // Bandwidths in bytes per second
+    double cache_bandwidth {50e9};
+
+    double memory_bandwidth {10e9};
+
+    double disk_read_bandwidth {2e9};
+
+    double disk_write_bandwidth {1e9};
+
+    // Latency of a single disk read in seconds
+    double disk_request_seconds {100e-6};
+};
+
+// Algorithm used to sort a cache-sized run
+enum class RunSort {
+    // LSD radix sort on the key followed by a pass that computes the offset-value codes. Does not allocate memory
+    RADIX,
+    // Tournament tree over single-row runs
+    TOURNAMENT,
+    // Tournament tree over blocks of SORTED_BLOCK_ROWS rows, each sorted by a sorting network first
+    BLOCK_TOURNAMENT
+};
+
+/**
+ * Struct holding the tunable parameters of a Sorter. Fields left at 0 are chosen for the current machine by resolve()
+ */
+struct SorterConfig {
+    // Size of a cache-sized run in bytes
+    size_t run_size {0};
+
+    // Maximum number of runs merged at once
+    size_t fan_in {0};
+
+    // Maximum number of runs merged at once by merges that read or write spilled runs. Such merges may take more
+    // inputs than the ones in memory, since a pass over the disk costs more than the comparisons saved by a smaller
+    // fan-in. The memory budget may limit it further. 0 means the larger of fan_in and DEFAULT_DISK_FAN_IN
+    size_t disk_fan_in {0};
+
+    // Bytes of sorted runs that are kept in CPU cache before the rest are flushed to memory
+    size_t cache_size {0};
+
+    // Bytes of sorted runs that are kept in memory before they are spilled to disk. With a memory broker, this is the
+    // most that the sort asks the broker for
+    size_t memory_budget {0};
+
+    // Broker that grants the memory of the sort, shared with the other sorts. nullptr means the process-wide broker
+    MemoryBroker *memory_broker {nullptr};
+
+    // Sorts with a higher priority may take memory back from sorts with a lower one
+    int priority {0};
+
+    // Directory for spilled runs. Empty means $TMPDIR or /tmp
+    std::string spill_directory;
+
+    // Generate runs by replacement selection with a tree of half the initial memory grant instead of sorting one run
+    // at a time
+    bool replacement_selection {false};
+
+    RunSort run_sort {RunSort::RADIX};
+
+    // Threads that sort full runs while more records are added, each pinned to a core. 0 means one per core, 1
+    // sorts the runs on the thread that adds the records. Replacement selection always runs on that thread
+    size_t run_threads {0};
+
+    // Threads that execute independent merges of the plan concurrently. 0 means one per core, 1 executes the plan
+    // depth-first on the calling thread
+    size_t merge_threads {0};
+
+    // Produce the output of the final merge on demand instead of materializing it, with the intermediate merges
+    // passing rows through small buffers. Merges whose output is spilled are still materialized. The final merge then
+    // runs on the thread that reads the output
+    bool streaming_merge {false};
+
+    // Fault in the pages of merge outputs and of runs read back from disk when they are allocated, rather than one
+    // page at a time as they are written. Only new mappings are faulted in; recycled buffers already are
+    bool prefault {true};
+
+    // Merge outputs of at least this many bytes are written with non-temporal stores. Such outputs have left the cache
+    // by the time they are read again, so writing them through the cache would only evict the inputs of the merge.
+    // 0 means the size of the L3 cache
+    size_t streaming_store_size {0};
+
+    // Cache lines ahead of the read position of every merge input that are prefetched in software, along with the
+    // tournament tree nodes that the next pass will visit. 0 leaves it to the hardware prefetcher
+    size_t prefetch_distance {4};
+
+    // Bytes of payload that come with every record (see Sorter::add_record). Only the keys are sorted and merged, each
+    // with the row id of its payload, and the payloads are gathered in sorted order as the records are returned. 0
+    // means the records have no payload
+    size_t payload_size {0};
+
+    // Store spilled runs in PAX pages (see SpillLayout), which leave out the padding of the rows and the row id slot of
+    // sorts without payloads. Disk traffic shrinks by that much, for the price of transposing every page
+    bool pax_runs {false};
+
+    CostModel cost_model;
+
+    static const size_t DEFAULT_DISK_FAN_IN = 256;
+
+    /**
+     * Returns a copy with all the unset fields filled in. The cache size defaults to the L2 size, the memory budget
+     * to a quarter of physical memory. Run size and fan-in are chosen by a short calibration benchmark that is run
+     * once per process, with rows of the default schema
+     */
+    SorterConfig resolve() const;
+
+    /**
+     * Like resolve(), for a sorter of type `SorterType`. The run size is rounded down to its rows, and the calibration
+     * benchmark sorts its rows with it, once per process and row type
+     */
+    template<typename SorterType>
+    SorterConfig resolve_for() const {
+        typedef typename SorterType::RowType RowType;
+        SorterConfig config = resolve_machine();
+        if (config.run_size) {
+            config.run_size = max(RoundDown(config.run_size, sizeof(RowType)), sizeof(RowType));
+        }
+        if (config.run_size == 0 || config.fan_in == 0) {
+            // Calibration results are shared by all the sorters with the same fixed fields
+            static std::mutex mutex;
+            static std::map<std::pair<size_t, size_t>, std::pair<size_t, size_t>> calibrated;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto key = std::make_pair(config.run_size, config.fan_in);
+            auto it = calibrated.find(key);
+            if (it == calibrated.end()) {
+                // Use a private generator so that the calibration does not disturb rand()
+                std::mt19937 generator {42};
+                std::vector<RowType> rows;
+                rows.reserve(CALIBRATION_ROWS);
+                for (size_t i=0; i<CALIBRATION_ROWS; i++) {
+                    rows.push_back(RowType::generate_random(generator));
+                }
+                config.calibrate(sizeof(RowType), [&rows] (const SorterConfig &candidate) {
+                    return measure_throughput<SorterType>(candidate, rows);
+                });
+                it = calibrated.emplace(key, std::make_pair(config.run_size, config.fan_in)).first;
+            }
+            config.run_size = it->second.first;
+            config.fan_in = it->second.second;
+        }
+        config.resolve_disk_fan_in();
+        return config;
+    }
+
+    std::string to_string() const;
+
+    // Layout of the spill files of runs of `RowType`
+    template<typename RowType>
+    SpillLayout get_spill_layout() const {
+        if (!pax_runs) {
+            return SpillLayout();
+        }
+        // The word after the key holds the row id of the payload
+        return SpillLayout {sizeof(RowType), RowType::KEY_WORDS + (payload_size? 1: 0)};
+    }
+
+private:
+    // Rows used by the calibration benchmark
+    static const size_t CALIBRATION_ROWS = 1 << 15;
+
+    // Copy with the fields that depend only on the machine filled in
+    SorterConfig resolve_machine() const;
+
+    /**
+     * Pick the run size and then the fan-in with the best throughput reported by `measure`, which sorts random rows
+     * of `row_size` bytes with the given configuration. Fields that are already set are kept
+     */
+    void calibrate(size_t row_size, const std::function<double(const SorterConfig&)> &measure);
+
+    // Default the disk fan-in once the fan-in is known
+    void resolve_disk_fan_in();
+
+    // Sort the rows with the given configuration. Returns the throughput in rows per second
+    template<typename SorterType, typename RowType>
+    static double measure_throughput(const SorterConfig &config, std::vector<RowType> &rows) {
+        auto start = std::chrono::steady_clock::now();
+        SorterType sorter {config};
+        for (auto& row: rows) {
+            sorter.add_record(&row);
+        }
+        sorter.sort_contents();
+        for (size_t i=0; i<rows.size(); i++) {
+            sorter.get_next_record();
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        return rows.size() / duration.count();
+    }
+};
@@ -0,0 +1,217 @@
+#include "SpillFile.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+SpillFile::SpillFile(int fd, const SpillLayout &layout): fd(fd), layout(layout), size(0), file_offset(0),
+        current_buffer(0) {
+    io = IOEngine::get_default();
+    write_buffers[0] = Alloc::create(BLOCK_SIZE);
+    write_buffers[1] = Alloc::create(BLOCK_SIZE);
+    if (layout.is_pax()) {
+        // Pages are expanded in place, which needs rows that are no smaller on disk than in memory
+        FinalAssert (layout.get_stored_row_size() <= layout.row_size);
+        rows_per_page = max(SpillLayout::PAX_PAGE_SIZE / layout.get_stored_row_size(), (size_t) 1);
+        page_rows.resize(rows_per_page * layout.row_size);
+    }
+}
+
+SpillFile::~SpillFile() {
+    // The buffers must outlive any write that is still in flight
+    wait_for_write(0);
+    wait_for_write(1);
+    close(fd);
+}
+
+std::shared_ptr<SpillFile> SpillFile::create(const std::string &directory, const SpillLayout &layout) {
+    std::string path = directory;
+    if (path.empty()) {
+        char const * const tmpdir = getenv("TMPDIR");
+        path = (tmpdir != nullptr && *tmpdir)? tmpdir: "/tmp";
+    }
+    path += "/sort_spill_XXXXXX";
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // Nobody else needs to open the file, so remove the name right away
+    unlink(path.c_str());
+    return std::make_shared<SpillFile>(fd, layout);
+}
+
+void SpillFile::write(const void *ptr, size_t bytes) {
+    size += bytes;
+    if (!layout.is_pax()) {
+        append(ptr, bytes);
+        return;
+    }
+    const char *src = static_cast<const char*>(ptr);
+    while (bytes > 0) {
+        size_t space = page_rows.size() - staged_bytes;
+        size_t chunk = (bytes < space)? bytes: space;
+        memcpy(&page_rows[staged_bytes], src, chunk);
+        src += chunk;
+        bytes -= chunk;
+        staged_bytes += chunk;
+        if (staged_bytes == page_rows.size()) {
+            write_page();
+        }
+    }
+}
+
+void SpillFile::append(const void *ptr, size_t bytes) {
+    const char *src = static_cast<const char*>(ptr);
+    while (bytes > 0) {
+        auto& write_buffer = write_buffers[current_buffer];
+        size_t space = BLOCK_SIZE - write_buffer->get_size();
+        size_t chunk = (bytes < space)? bytes: space;
+        write_buffer->write(src, chunk);
+        src += chunk;
+        bytes -= chunk;
+        if (write_buffer->get_size() == BLOCK_SIZE) {
+            write_out_buffer();
+        }
+    }
+}
+
+void SpillFile::write_page() {
+    // Only the last page of a file is partial. Its minipages are as long as its rows
+    size_t rows = staged_bytes / layout.row_size;
+    char page[SpillLayout::PAX_PAGE_SIZE];
+    char *minipage = page;
+    for (size_t i=0; i<rows; i++) {
+        memcpy(minipage + i * sizeof(uint64_t), &page_rows[i * layout.row_size], sizeof(uint64_t));
+    }
+    minipage += rows * sizeof(uint64_t);
+    for (size_t word=0; word<layout.words; word++) {
+        const char *column = &page_rows[sizeof(uint64_t) + word * sizeof(uint32_t)];
+        for (size_t i=0; i<rows; i++) {
+            memcpy(minipage + i * sizeof(uint32_t), column + i * layout.row_size, sizeof(uint32_t));
+        }
+        minipage += rows * sizeof(uint32_t);
+    }
+    append(page, minipage - page);
+    staged_bytes = 0;
+}
+
+void SpillFile::finish() {
+    if (staged_bytes) {
+        write_page();
+    }
+    if (write_buffers[current_buffer]->get_size()) {
+        write_out_buffer();
+    }
+    wait_for_write(0);
+    wait_for_write(1);
+    // The file is read-only from now on
+    write_buffers[0] = nullptr;
+    write_buffers[1] = nullptr;
+}
+
+void SpillFile::write_out_buffer() {
+    auto& write_buffer = write_buffers[current_buffer];
+    pending_writes[current_buffer] = io->write(fd, write_buffer->get_addr(), write_buffer->get_size(), file_offset);
+    file_offset += write_buffer->get_size();
+    // Continue filling the other buffer while this one is written out
+    current_buffer ^= 1;
+    wait_for_write(current_buffer);
+    write_buffers[current_buffer]->clear();
+}
+
+void SpillFile::wait_for_write(int buffer_idx) {
+    auto& request = pending_writes[buffer_idx];
+    if (request == nullptr) {
+        return;
+    }
+    io->wait(request);
+    FinalAssert (request->error == 0);
+    request = nullptr;
+}
+
+size_t SpillFile::read_block(size_t offset, Alloc &buffer, size_t block_size) {
+    return finish_read(start_read(offset, buffer, block_size), buffer);
+}
+
+std::shared_ptr<IORequest> SpillFile::start_read(size_t offset, Alloc &buffer, size_t block_size) {
+    buffer.clear();
+    if (layout.is_pax()) {
+        // Only whole pages are read, so the block ends where a page ends or at the end of the file
+        size_t block = RoundDown(block_size, rows_per_page * layout.row_size);
+        FinalAssert (block > 0);
+        block = (size - offset < block)? size - offset: block;
+        return start_page_read(offset, static_cast<char*>(buffer.get_addr()), block);
+    }
+    size_t bytes = (file_offset - offset < block_size)? file_offset - offset: block_size;
+    return io->read(fd, buffer.get_addr(), bytes, offset);
+}
+
+void SpillFile::read(size_t offset, void *ptr, size_t bytes) {
+    if (layout.is_pax()) {
+        char *dest = static_cast<char*>(ptr);
+        FinalAssert (finish_page_read(start_page_read(offset, dest, bytes), dest) == bytes);
+        return;
+    }
+    auto request = io->read(fd, ptr, bytes, offset);
+    io->wait(request);
+    FinalAssert (request->error == 0 && request->done_bytes == bytes);
+}
+
+std::shared_ptr<IORequest> SpillFile::start_read(size_t offset, void *ptr, size_t bytes) {
+    return io->read(fd, ptr, bytes, offset);
+}
+
+void SpillFile::wait_for_read(const std::shared_ptr<IORequest> &request) {
+    io->wait(request);
+    FinalAssert (request->error == 0 && request->done_bytes == request->bytes);
+}
+
+size_t SpillFile::finish_read(const std::shared_ptr<IORequest> &request, Alloc &buffer) {
+    if (layout.is_pax()) {
+        buffer.set_size(finish_page_read(request, static_cast<char*>(buffer.get_addr())));
+        return buffer.get_size();
+    }
+    io->wait(request);
+    FinalAssert (request->error == 0);
+    buffer.set_size(request->done_bytes);
+    return request->done_bytes;
+}
+
+std::shared_ptr<IORequest> SpillFile::start_page_read(size_t offset, char *dest, size_t bytes) {
+    size_t page_size = rows_per_page * layout.row_size;
+    FinalAssert (offset % page_size == 0 && offset + bytes <= size);
+    size_t stored_bytes = layout.get_stored_size(bytes);
+    return io->read(fd, dest + bytes - stored_bytes, stored_bytes, layout.get_stored_size(offset));
+}
+
+size_t SpillFile::finish_page_read(const std::shared_ptr<IORequest> &request, char *dest) {
+    io->wait(request);
+    FinalAssert (request->error == 0 && request->done_bytes == request->bytes);
+    size_t stored_row_size = layout.get_stored_row_size();
+    size_t rows = request->bytes / stored_row_size;
+    size_t bytes = rows * layout.row_size;
+    // A page is copied out before it is expanded, since its rows may overwrite it. They never reach the pages after
+    // it, which take up no more room on disk than in memory
+    const char *stored = dest + bytes - request->bytes;
+    char page[SpillLayout::PAX_PAGE_SIZE];
+    for (size_t first=0; first<rows; first+=rows_per_page) {
+        size_t page_rows = (rows - first < rows_per_page)? rows - first: rows_per_page;
+        memcpy(page, stored, page_rows * stored_row_size);
+        stored += page_rows * stored_row_size;
+        char *row = dest + first * layout.row_size;
+        const char *minipage = page;
+        for (size_t i=0; i<page_rows; i++) {
+            memcpy(row + i * layout.row_size, minipage + i * sizeof(uint64_t), sizeof(uint64_t));
+            memset(row + i * layout.row_size + stored_row_size, 0, layout.row_size - stored_row_size);
+        }
+        minipage += page_rows * sizeof(uint64_t);
+        for (size_t word=0; word<layout.words; word++) {
+            char *column = row + sizeof(uint64_t) + word * sizeof(uint32_t);
+            for (size_t i=0; i<page_rows; i++) {
+                memcpy(column + i * layout.row_size, minipage + i * sizeof(uint32_t), sizeof(uint32_t));
+            }
+            minipage += page_rows * sizeof(uint32_t);
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include "defs.h"
+#include "Alloc.h"
+#include "IOEngine.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Layout of the rows in a spill file. By default the bytes are stored as they are written. A PAX layout stores the
+ * rows in pages of PAX_PAGE_SIZE bytes, in which the offset-value codes of the rows sit in one minipage and each of
+ * the first `words` key words in a minipage of its own. The rest of a row (the padding, or a row id slot that is not
+ * used) is not stored and reads back as zeros
+ */
+struct SpillLayout {
+    // Bytes of a row in memory: the 8-byte offset-value code followed by 4-byte words
+    size_t row_size {0};
+
+    // Words after the code that are stored. 0 stores the rows as they are
+    size_t words {0};
+
+    bool is_pax() const {
+        return words != 0;
+    }
+
+    // Bytes of a row in a PAX page
+    size_t get_stored_row_size() const {
+        return sizeof(uint64_t) + words * sizeof(uint32_t);
+    }
+
+    // Bytes on disk for `bytes` bytes of rows
+    size_t get_stored_size(size_t bytes) const {
+        return is_pax()? bytes / row_size * get_stored_row_size(): bytes;
+    }
+
+    static const size_t PAX_PAGE_SIZE = 4096;
+};
+
+/**
+ * Class to represent a sorted run that has been spilled to a temporary file. Writes are staged in page-aligned
+ * buffers and appended to the file one block at a time in the background (write-behind), reads are done one block
+ * at a time into a caller-owned buffer and can be started ahead of time (read-ahead)
+ */
+class SpillFile {
+public:
+    SpillFile(int fd, const SpillLayout &layout = SpillLayout());
+
+    ~SpillFile();
+
+    /**
+     * Create an unlinked temporary file in the given directory. The disk space is released once the file is closed.
+     * If the directory is empty, $TMPDIR (or /tmp) is used
+     */
+    static std::shared_ptr<SpillFile> create(const std::string &directory = "",
+                                             const SpillLayout &layout = SpillLayout());
+
+    // Append bytes to the end of the file
+    void write(const void *ptr, size_t bytes);
+
+    // Write out the partially filled block and wait for all the writes. Must be called before the file is read
+    void finish();
+
+    // Read up to `block_size` bytes starting at `offset` into `buffer`. Returns the number of bytes read
+    size_t read_block(size_t offset, Alloc &buffer, size_t block_size = BLOCK_SIZE);
+
+    // Start reading up to `block_size` bytes starting at `offset` into `buffer`. Readers of rows pass a block size of
+    // whole rows, so that no row is split between two blocks. With a PAX layout the block is rounded down to whole
+    // pages, and `offset` must be where a block ended. `buffer` must not be used until the read has been completed
+    // with finish_read()
+    std::shared_ptr<IORequest> start_read(size_t offset, Alloc &buffer, size_t block_size = BLOCK_SIZE);
+
+    // Read `bytes` bytes starting at `offset` into memory. With a PAX layout `offset` must start a page
+    void read(size_t offset, void *ptr, size_t bytes);
+
+    // Start reading exactly `bytes` bytes starting at `offset` into `ptr`, which must stay valid until the read has
+    // been completed with wait_for_read(). Only for files without a PAX layout
+    std::shared_ptr<IORequest> start_read(size_t offset, void *ptr, size_t bytes);
+
+    void wait_for_read(const std::shared_ptr<IORequest> &request);
+
+    // Wait for a read started with start_read(). Returns the number of bytes read
+    size_t finish_read(const std::shared_ptr<IORequest> &request, Alloc &buffer);
+
+    inline size_t get_size() {
+        return size;
+    }
+
+    static const size_t BLOCK_SIZE = 1 << 18;
+
+private:
+    int fd;
+
+    SpillLayout layout;
+
+    // Number of bytes appended so far. With a PAX layout these are the bytes of the rows, not of their pages
+    size_t size;
+
+    // Number of bytes that have been handed to the I/O engine
+    size_t file_offset;
+
+    std::shared_ptr<IOEngine> io;
+
+    // Records are staged in one buffer while the other one is being written out
+    std::shared_ptr<Alloc> write_buffers[2];
+
+    std::shared_ptr<IORequest> pending_writes[2];
+
+    // Index of the buffer that is currently being filled
+    int current_buffer;
+
+    // Rows of a PAX layout are staged here until they fill a page
+    std::vector<char> page_rows;
+
+    size_t staged_bytes {0};
+
+    // Rows in a full PAX page
+    size_t rows_per_page {0};
+
+    // Append bytes to the write buffers as they are
+    void append(const void *ptr, size_t bytes);
+
+    // Append the staged rows as one PAX page
+    void write_page();
+
+    // Start reading the pages of the `bytes` bytes of rows at `offset` to the end of `dest`, so that they can be
+    // expanded in place
+    std::shared_ptr<IORequest> start_page_read(size_t offset, char *dest, size_t bytes);
+
+    // Wait for a read started with start_page_read() and expand its pages into rows. Returns the bytes of the rows
+    size_t finish_page_read(const std::shared_ptr<IORequest> &request, char *dest);
+
+    void write_out_buffer();
+
+    void wait_for_write(int buffer_idx);
+};
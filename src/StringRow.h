@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Record.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * Record with a variable-length string key. The first PREFIX_WORDS words of the string are kept in the record as a
+ * normalized prefix (big-endian, padded with zeros), and the string itself lies in the arena of the block that holds
+ * the record (see StringBlock). Offset-value codes count the prefix words and one more word that stands for the whole
+ * string: a record whose prefix is equal to that of the record it is coded relative to gets STRING_CODE, or 0 if the
+ * strings are equal too. The strings are only compared when the prefixes tie
+ */
+class StringRow {
+public:
+    static constexpr uint32_t PREFIX_WORDS = 3;
+
+    // Arity for ascending OVC
+    static constexpr uint32_t KEY_WORDS = PREFIX_WORDS + 1;
+
+    // Code of a record that differs from the record it is coded relative to after the prefix
+    static constexpr OVC STRING_CODE = 1 * OFFSET_MULTIPLIER + 1;
+
+    StringRow() = default;
+
+    StringRow(const char *string, uint32_t length): length(length), string(string) {
+        for (uint32_t i=0; i<PREFIX_WORDS; i++) {
+            uint32_t word = 0;
+            for (uint32_t byte=0; byte<4; byte++) {
+                uint32_t offset = 4*i + byte;
+                word = word << 8 | (offset < length? (uint8_t) string[offset]: 0);
+            }
+            prefix[i] = word;
+        }
+        reset_ovc();
+    }
+
+    inline const char* get_string() const {
+        return string;
+    }
+
+    inline uint32_t get_length() const {
+        return length;
+    }
+
+    // For debugging
+    std::string to_string() const {
+        return std::string(string, length);
+    }
+
+    // Bit i is set if prefix word i differs between the two records
+    inline uint32_t differing_words(const StringRow &other) const {
+        uint32_t differing = 0;
+        for (uint32_t i=0; i<PREFIX_WORDS; i++) {
+            differing |= (uint32_t) (prefix[i] != other.prefix[i]) << i;
+        }
+        return differing;
+    }
+
+    // Negative, zero or positive as the string of this record is smaller than, equal to or larger than the other one
+    inline int compare_strings(const StringRow &other) const {
+        int result = memcmp(string, other.string, std::min(length, other.length));
+        if (result != 0) {
+            return result;
+        }
+        return (length > other.length) - (length < other.length);
+    }
+
+    /**
+     * Break a tie between the equal codes `a_ovc` and `b_ovc` of records `a` and `b`, which agree on the key words
+     * before `first_word`. The code of the loser is made relative to the winner, and if the keys are equal `a` loses
+     * and is coded as a duplicate. Returns whether `a` wins
+     */
+    static inline bool break_tie(const StringRow &a, OVC &a_ovc, const StringRow &b, OVC &b_ovc,
+                                 uint32_t first_word) {
+        uint32_t differing = a.differing_words(b) & (~0u << std::min(first_word, PREFIX_WORDS));
+        if (differing != 0) {
+            uint32_t i = __builtin_ctz(differing);
+            if (a.prefix[i] < b.prefix[i]) {
+                b_ovc = (KEY_WORDS-i) * OFFSET_MULTIPLIER + b.prefix[i];
+                return true;
+            }
+            a_ovc = (KEY_WORDS-i) * OFFSET_MULTIPLIER + a.prefix[i];
+            return false;
+        }
+        if (first_word > KEY_WORDS) {
+            // Both are duplicates of the same record
+            a_ovc = 0;
+            return false;
+        }
+        int result = a.compare_strings(b);
+        if (result < 0) {
+            b_ovc = STRING_CODE;
+            return true;
+        }
+        a_ovc = (result == 0)? 0: STRING_CODE;
+        return false;
+    }
+
+    inline bool operator <(StringRow &other) {
+        if (ovc != other.ovc) {
+            return ovc < other.ovc;
+        }
+        return break_tie(*this, ovc, other, other.ovc, KEY_WORDS - (ovc >> 32) + 1);
+    }
+
+    // Code relative to negative infinity, i.e. for the first record of a run
+    inline void reset_ovc() {
+        ovc = KEY_WORDS * OFFSET_MULTIPLIER + prefix[0];
+    }
+
+    /**
+     * Compare with a record that precedes this one in the output. If this record is not smaller, set its offset-value
+     * code relative to `prev` and return true. Otherwise return false and leave the code unchanged
+     */
+    inline bool code_relative_to(const StringRow &prev) {
+        uint32_t differing = differing_words(prev);
+        if (differing != 0) {
+            uint32_t i = __builtin_ctz(differing);
+            if (prefix[i] < prev.prefix[i]) {
+                return false;
+            }
+            ovc = (KEY_WORDS-i) * OFFSET_MULTIPLIER + prefix[i];
+            return true;
+        }
+        int result = compare_strings(prev);
+        if (result < 0) {
+            return false;
+        }
+        ovc = (result == 0)? 0: STRING_CODE;
+        return true;
+    }
+
+    // Compare the keys without using offset-value codes
+    inline bool key_less(const StringRow &other) const {
+        uint32_t differing = differing_words(other);
+        if (differing != 0) {
+            uint32_t i = __builtin_ctz(differing);
+            return prefix[i] < other.prefix[i];
+        }
+        return compare_strings(other) < 0;
+    }
+
+    OVC ovc;
+
+private:
+    // Blocks copy the strings into their arenas and write them to disk as offsets
+    friend class StringBlock;
+
+    uint32_t prefix[PREFIX_WORDS];
+
+    uint32_t length;
+
+    const char *string;
+};
+
+static_assert(std::is_trivially_copyable<StringRow>::value, "Rows are copied with memcpy");
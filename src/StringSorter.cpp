@@ -0,0 +1,204 @@
+#include "StringSorter.h"
+#include "defs.h"
+#include <algorithm>
+#include <cstring>
+
+// Method definitions for StringBlock
+std::shared_ptr<StringBlock> StringBlock::create() {
+    auto block = std::make_shared<StringBlock>();
+    block->alloc = Alloc::create(BLOCK_SIZE);
+    if (block->alloc == nullptr) {
+        return nullptr;
+    }
+    block->clear();
+    return block;
+}
+
+void StringBlock::clear() {
+    header()->num_rows = 0;
+    header()->arena_offset = BLOCK_SIZE;
+}
+
+bool StringBlock::append(const StringRow &row) {
+    Header *block_header = header();
+    char *base = static_cast<char*>(alloc->get_addr());
+    size_t rows_end = sizeof(Header) + (block_header->num_rows + 1) * sizeof(StringRow);
+    if (rows_end + row.length > block_header->arena_offset) {
+        return false;
+    }
+    block_header->arena_offset -= row.length;
+    char *string = base + block_header->arena_offset;
+    memcpy(string, row.string, row.length);
+    StringRow *copy = end();
+    *copy = row;
+    copy->string = string;
+    block_header->num_rows++;
+    return true;
+}
+
+void StringBlock::sort() {
+    std::sort(begin(), end(), [](const StringRow &a, const StringRow &b) {
+        return a.key_less(b);
+    });
+    if (empty()) {
+        return;
+    }
+    begin()->reset_ovc();
+    for (StringRow *row = begin() + 1; row < end(); row++) {
+        row->code_relative_to(row[-1]);
+    }
+}
+
+void StringBlock::write_to(SpillFile &file) {
+    const char *base = static_cast<char*>(alloc->get_addr());
+    for (StringRow *row = begin(); row < end(); row++) {
+        // Store the strings as offsets into the block, which are turned back into pointers when it is read
+        row->string = reinterpret_cast<const char*>(row->string - base);
+    }
+    file.write(base, BLOCK_SIZE);
+}
+
+void StringBlock::read_from(SpillFile &file, size_t offset) {
+    const char *base = static_cast<char*>(alloc->get_addr());
+    file.read(offset, alloc->get_addr(), BLOCK_SIZE);
+    for (StringRow *row = begin(); row < end(); row++) {
+        row->string = base + reinterpret_cast<uintptr_t>(row->string);
+    }
+}
+
+
+// Method definitions for StringRunReader
+StringRunReader::StringRunReader(std::shared_ptr<StringRun> run): run(std::move(run)) {}
+
+void StringRunReader::read_batch(StringRow *&begin, StringRow *&end) {
+    if (next_block == run->num_blocks) {
+        begin = end = nullptr;
+        return;
+    }
+    StringBlock *block;
+    if (run->file != nullptr) {
+        if (buffer == nullptr) {
+            buffer = StringBlock::create();
+            FinalAssert (buffer != nullptr);
+        }
+        buffer->read_from(*run->file, next_block * StringBlock::BLOCK_SIZE);
+        block = buffer.get();
+    } else {
+        block = run->blocks[next_block].get();
+    }
+    next_block++;
+    begin = block->begin();
+    end = block->end();
+}
+
+
+// Method definitions for StringSorter
+StringSorter::StringSorter(const SorterConfig &config): config(config.resolve()) {
+    // Admitted with room for the block being filled. The rest is asked for as the runs fill it up
+    memory_grant = this->config.memory_broker->admit(
+        min(StringBlock::BLOCK_SIZE, this->config.memory_budget), this->config.memory_budget, this->config.priority,
+        [this] (size_t memory_budget) {
+            this->memory_budget = memory_budget;
+        });
+    memory_budget = memory_grant->get_size();
+    current_block = StringBlock::create();
+    FinalAssert (current_block != nullptr);
+}
+
+void StringSorter::add_record(const char *string, uint32_t length) {
+    FinalAssert (length <= StringBlock::MAX_STRING_LENGTH);
+    StringRow row {string, length};
+    if (current_block->append(row)) {
+        return;
+    }
+    sort_current_block();
+    // Like Sorter, the grant is grown at least twofold, so that the broker is asked a logarithmic number of times
+    size_t needed = memory_used + StringBlock::BLOCK_SIZE;
+    if (needed > memory_budget && memory_grant->request(max(needed, 2 * memory_budget)) < needed) {
+        // The runs in memory and a new block do not fit in what the broker grants
+        spill_runs();
+    }
+    current_block = StringBlock::create();
+    FinalAssert (current_block != nullptr && current_block->append(row));
+}
+
+void StringSorter::set_memory_budget(size_t memory_budget) {
+    memory_grant->set_maximum(memory_budget);
+}
+
+void StringSorter::sort_current_block() {
+    current_block->sort();
+    auto run = std::make_shared<StringRun>();
+    run->blocks.push_back(std::move(current_block));
+    run->num_blocks = 1;
+    runs.push_back(std::move(run));
+    memory_used += StringBlock::BLOCK_SIZE;
+}
+
+void StringSorter::spill_runs() {
+    if (runs.empty()) {
+        return;
+    }
+    spilled_runs.push_back(merge_runs(runs));
+    runs.clear();
+    memory_used = 0;
+}
+
+std::shared_ptr<StringRun> StringSorter::merge_runs(const std::vector<std::shared_ptr<StringRun>> &inputs) {
+    auto output = std::make_shared<StringRun>();
+    output->file = SpillFile::create(config.spill_directory);
+    FinalAssert (output->file != nullptr);
+    num_spilled_runs++;
+    std::vector<std::shared_ptr<StringRunReader>> readers;
+    for (auto &input: inputs) {
+        readers.push_back(std::make_shared<StringRunReader>(input));
+    }
+    auto block = StringBlock::create();
+    FinalAssert (block != nullptr);
+    auto finish_block = [&output, &block] {
+        block->write_to(*output->file);
+        block->clear();
+        output->num_blocks++;
+    };
+    with_tournament_tree(readers, config.prefetch_distance, [&block, &finish_block] (auto &tree) {
+        while (StringRow *top_record = tree.pop()) {
+            if (!block->append(*top_record)) {
+                finish_block();
+                block->append(*top_record);
+            }
+        }
+    });
+    if (!block->empty()) {
+        finish_block();
+    }
+    output->file->finish();
+    return output;
+}
+
+void StringSorter::sort_contents() {
+    if (!current_block->empty()) {
+        sort_current_block();
+    }
+    current_block = nullptr;
+    std::vector<std::shared_ptr<StringRun>> inputs = spilled_runs;
+    inputs.insert(inputs.end(), runs.begin(), runs.end());
+    spilled_runs.clear();
+    runs.clear();
+    // Merge groups of the oldest runs until a single merge is left
+    size_t fan_in = max(config.fan_in, (size_t) 2);
+    while (inputs.size() > fan_in) {
+        std::vector<std::shared_ptr<StringRun>> group(inputs.begin(), inputs.begin() + fan_in);
+        inputs.erase(inputs.begin(), inputs.begin() + fan_in);
+        inputs.push_back(merge_runs(group));
+    }
+    for (auto &input: inputs) {
+        final_inputs.push_back(std::make_shared<StringRunReader>(input));
+    }
+    if (!final_inputs.empty()) {
+        final_tree = std::make_unique<TournamentTree<StringRunReader>>(final_inputs, config.prefetch_distance);
+    }
+}
+
+StringRow* StringSorter::get_next_record() {
+    return (final_tree != nullptr)? final_tree->pop(): nullptr;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "StringRow.h"
+#include "Alloc.h"
+#include "SpillFile.h"
+#include "SorterConfig.h"
+#include "Tree.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/**
+ * Block of string rows together with the arena that holds their strings. The rows are stored from the start of the
+ * block, after a header, and the strings from its end down, so that a block is self-contained: it is spilled and read
+ * back as a whole, and its rows are pointed back at its strings wherever it ends up in memory
+ */
+class StringBlock {
+public:
+    // Returns nullptr if the memory could not be allocated
+    static std::shared_ptr<StringBlock> create();
+
+    /**
+     * Append a row with its offset-value code and a copy of its string. Returns false if the block has no room for it
+     */
+    bool append(const StringRow &row);
+
+    inline StringRow* begin() {
+        return reinterpret_cast<StringRow*>(static_cast<char*>(alloc->get_addr()) + sizeof(Header));
+    }
+
+    inline StringRow* end() {
+        return begin() + header()->num_rows;
+    }
+
+    inline bool empty() {
+        return header()->num_rows == 0;
+    }
+
+    // Remove all the rows so that the block can be refilled
+    void clear();
+
+    // Sort the rows and code them as a run
+    void sort();
+
+    // Write the block to the end of `file`. The block must be cleared or read into before it is used again
+    void write_to(SpillFile &file);
+
+    // Replace the contents with the block at `offset` of `file`
+    void read_from(SpillFile &file, size_t offset);
+
+    static const size_t BLOCK_SIZE = 1 << 18;
+
+    // Longest string that always fits in an empty block
+    static const size_t MAX_STRING_LENGTH = BLOCK_SIZE / 4;
+
+private:
+    struct Header {
+        uint64_t num_rows;
+
+        // Offset of the first byte of the arena from the start of the block
+        uint64_t arena_offset;
+    };
+
+    std::shared_ptr<Alloc> alloc;
+
+    inline Header* header() {
+        return static_cast<Header*>(alloc->get_addr());
+    }
+};
+
+/**
+ * Sorted run of string rows, as a sequence of blocks in memory or in a spill file
+ */
+struct StringRun {
+    std::vector<std::shared_ptr<StringBlock>> blocks;
+
+    std::shared_ptr<SpillFile> file {nullptr};
+
+    size_t num_blocks {0};
+};
+
+/**
+ * Reader of a string run for a tournament tree. Every batch is the rows of one block. A spilled run is read one block
+ * at a time into a single buffer, so its rows stay valid until the next batch
+ */
+class StringRunReader {
+public:
+    typedef StringRow RowType;
+
+    StringRunReader(std::shared_ptr<StringRun> run);
+
+    void read_batch(StringRow *&begin, StringRow *&end);
+
+private:
+    std::shared_ptr<StringRun> run;
+
+    size_t next_block {0};
+
+    std::shared_ptr<StringBlock> buffer {nullptr};
+};
+
+/**
+ * Class sorting records with variable-length string keys. Records are collected into blocks, and every full block is
+ * sorted as a run. Runs are kept in memory while the memory broker grants room for them, up to the memory budget, after
+ * which they are merged into a run in a spill file. At the end, the runs are merged with at most `fan_in` inputs per
+ * merge, and the last merge streams its output to get_next_record()
+ */
+class StringSorter {
+public:
+    StringSorter(const SorterConfig &config = SorterConfig());
+
+    // Add a record with a copy of its key. The key may be at most StringBlock::MAX_STRING_LENGTH bytes long
+    void add_record(const char *string, uint32_t length);
+
+    /**
+     * Sort all records. This is called after all records have been added
+     */
+    void sort_contents();
+
+    /**
+     * Return the next record in sorted order, with its offset-value code relative to the previous one, or nullptr once
+     * all the records have been returned. The record and its string stay valid until the next call
+     */
+    StringRow* get_next_record();
+
+    const SorterConfig& get_config() {
+        return config;
+    }
+
+    /**
+     * Change the most memory that the sort may use. This may be called from any thread and takes effect when the next
+     * block is started. See Sorter::set_memory_budget()
+     */
+    void set_memory_budget(size_t memory_budget);
+
+    // Number of runs that have been written to spill files, including intermediate merges
+    size_t get_num_spilled_runs() {
+        return num_spilled_runs;
+    }
+
+private:
+    SorterConfig config;
+
+    std::shared_ptr<StringBlock> current_block;
+
+    // Sorted runs that are kept in memory
+    std::vector<std::shared_ptr<StringRun>> runs;
+
+    std::vector<std::shared_ptr<StringRun>> spilled_runs;
+
+    // Bytes of the runs in memory, not counting the block being filled
+    size_t memory_used {0};
+
+    // Memory granted by the broker, which the callback of the grant may change from another thread
+    std::atomic<size_t> memory_budget;
+
+    std::unique_ptr<MemoryGrant> memory_grant {nullptr};
+
+    size_t num_spilled_runs {0};
+
+    std::vector<std::shared_ptr<StringRunReader>> final_inputs;
+
+    std::unique_ptr<TournamentTree<StringRunReader>> final_tree {nullptr};
+
+    // Sort the current block and keep it as a run in memory
+    void sort_current_block();
+
+    // Merge all the runs in memory into a single spilled run
+    void spill_runs();
+
+    // Merge the runs into a single run in a spill file
+    std::shared_ptr<StringRun> merge_runs(const std::vector<std::shared_ptr<StringRun>> &inputs);
+};
@@ -3,11 +3,34 @@
 #include "Filter.h"
 #include "Sort.h"
 #include "Witness.h"
+#include "StringSorter.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <chrono>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 
-void run_test(uint32_t num_rows) {
+/**
+ * Configuration the tests below were written for: 4 KB runs, 64 KB of cache and a fan-in of 16. Runs are sorted and
+ * merged on the calling thread, so that the serial paths are covered whatever the number of cores. The tests of the
+ * parallel paths ask for threads explicitly
+ */
+SorterConfig test_config(size_t memory_budget = 1ull << 30) {
+	SorterConfig config;
+	config.run_size = 4096;
+	config.fan_in = 16;
+	config.cache_size = 65536;
+	config.run_threads = 1;
+	config.merge_threads = 1;
+	config.memory_budget = memory_budget;
+	return config;
+}
+
+void run_test(uint32_t num_rows, SorterConfig const & config = test_config()) {
 	Plan * const plan =
 			new WitnessPlan ("output",
 				new SortPlan ("*** The main thing! ***",
@@ -15,7 +38,8 @@ void run_test(uint32_t num_rows) {
 						new FilterPlan ("half",
 							new ScanPlan ("source", num_rows)
 						)
-					)
+					),
+					config
 				)
 			);
 
@@ -86,6 +110,567 @@ void test_external_merge_sort2() {
 	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
 }
 
+/**
+ * Checks external merge sort with runs spilled to disk (memory budget much smaller than the input)
+ */
+void test_spilling_merge_sort() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for checking external merge sort with spilling (num_rows=200000, memory=256KB) *****\n");
+	run_test(200000, test_config(1 << 18));
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+/**
+ * Checks external merge sort with spilled runs stored in PAX pages, with runs written by merges and by replacement
+ * selection
+ */
+void test_pax_runs() {
+	for (bool replacement_selection: {false, true}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		printf("\n***** Running test for checking spilled runs in PAX pages (num_rows=200000, memory=256KB%s) *****\n",
+				replacement_selection? ", replacement selection": "");
+		SorterConfig config = test_config(1 << 18);
+		config.pax_runs = true;
+		config.replacement_selection = replacement_selection;
+		run_test(200000, config);
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+}
+
+/**
+ * Checks sorting with run size, fan-in and cache size detected for the current machine
+ */
+void test_calibrated_config() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for checking sort with a calibrated configuration (num_rows=100000) *****\n");
+	run_test(100000, SorterConfig());
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms (including calibration)\n";
+}
+
+/**
+ * Checks external merge sort with runs generated by replacement selection, including runs that outgrow memory
+ */
+void test_replacement_selection() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for checking replacement selection (num_rows=200000, memory=256KB) *****\n");
+	SorterConfig config = test_config(1 << 18);
+	config.replacement_selection = true;
+	run_test(200000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_tournament_run_sort() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for sorting runs with a tournament tree (num_rows=100000) *****\n");
+	SorterConfig config = test_config();
+	config.run_sort = RunSort::TOURNAMENT;
+	run_test(100000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_block_tournament_run_sort() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for sorting runs with a tournament tree over presorted blocks (num_rows=100000) *****\n");
+	SorterConfig config = test_config();
+	config.run_sort = RunSort::BLOCK_TOURNAMENT;
+	run_test(100000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_parallel_run_generation() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for sorting runs on 4 threads (num_rows=200000, memory=256KB) *****\n");
+	SorterConfig config = test_config(1 << 18);
+	config.run_threads = 4;
+	run_test(200000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_parallel_merge() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for executing the merge plan on 4 threads (num_rows=400000, memory=256KB) *****\n");
+	SorterConfig config = test_config(1 << 18);
+	config.fan_in = 4;
+	config.merge_threads = 4;
+	run_test(400000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_parallel_final_merge() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for splitting the final merge across 4 threads (num_rows=400000) *****\n");
+	SorterConfig config = test_config();
+	config.merge_threads = 4;
+	run_test(400000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_streaming_merge() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for streaming the merge output (num_rows=400000, fan-in=4) *****\n");
+	SorterConfig config = test_config();
+	config.fan_in = 4;
+	config.streaming_merge = true;
+	run_test(400000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+void test_cost_based_plan() {
+	for (size_t disk_fan_in: {0, 4}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		printf("\n***** Running test for planning merges for a slow disk (num_rows=400000, memory=256KB, disk fan-in=%zu) "
+				"*****\n", disk_fan_in);
+		SorterConfig config = test_config(1 << 18);
+		config.disk_fan_in = disk_fan_in;
+		config.cost_model.disk_read_bandwidth = 100e6;
+		config.cost_model.disk_write_bandwidth = 100e6;
+		config.cost_model.disk_request_seconds = 5e-3;
+		run_test(400000, config);
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+}
+
+
+/**
+ * Write the output of every merge with non-temporal stores
+ */
+void test_streaming_stores() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for non-temporal merge output (num_rows=400000) *****\n");
+	SorterConfig config = test_config();
+	config.streaming_store_size = 1;
+	run_test(400000, config);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+/**
+ * Merge with a high fan-in at several software prefetch distances
+ */
+void test_prefetch_distance() {
+	for (size_t distance : {0, 2, 4, 8, 16}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		printf("\n***** Running test for prefetching %zu cache lines ahead (num_rows=800000, fan-in=256) *****\n", distance);
+		SorterConfig config = test_config();
+		config.fan_in = 256;
+		config.prefetch_distance = distance;
+		run_test(800000, config);
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+}
+
+/**
+ * Change the memory budget while records are added and again while the runs are merged
+ */
+void test_memory_resize() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for resizing memory during a sort (num_rows=400000, memory=4MB/256KB/8MB/512KB) *****\n");
+	const size_t num_rows = 400000;
+	std::vector<Row> rows;
+	rows.reserve(num_rows);
+	auto random_word = [] { return (uint32_t) rand(); };
+	for (size_t i=0; i<num_rows; i++) {
+		rows.push_back(Row::generate_random(random_word));
+	}
+	Sorter sorter {test_config(4 << 20)};
+	for (size_t i=0; i<num_rows; i++) {
+		if (i == num_rows / 3)
+			sorter.set_memory_budget(1 << 18);
+		else if (i == 2 * num_rows / 3)
+			sorter.set_memory_budget(8 << 20);
+		sorter.add_record(&rows[i]);
+	}
+	// Shrink the budget from another thread while the runs are merged
+	std::thread resizer([&sorter] {
+		sorter.set_memory_budget(1 << 19);
+	});
+	sorter.sort_contents();
+	resizer.join();
+
+	size_t inversions = 0;
+	Row previous = sorter.get_next_record();
+	for (size_t i=1; i<num_rows; i++) {
+		Row &row = sorter.get_next_record();
+		if (row.key_less(previous))
+			inversions++;
+		previous = row;
+	}
+	printf("%zu plans, %zu inversions\n", sorter.get_plan_reports().size(), inversions);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+/**
+ * Run two sorts at once that share a small pool of memory, one of them with a higher priority
+ */
+void test_memory_broker() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for sharing memory between sorts (2 x num_rows=200000, pool=1MB) *****\n");
+	MemoryBroker broker {1 << 20};
+	SorterConfig low_priority = test_config(1 << 20);
+	low_priority.memory_broker = &broker;
+	SorterConfig high_priority = low_priority;
+	high_priority.priority = 1;
+	std::thread low([&low_priority] {
+		run_test(200000, low_priority);
+	});
+	run_test(200000, high_priority);
+	low.join();
+	printf("%s\n", broker.to_string().c_str());
+	// Raising the maximum of a grant hands it the free memory of the pool right away
+	size_t resized = 0;
+	auto grant = broker.admit(1 << 18, 1 << 18, 0, [&resized] (size_t size) {
+		resized = size;
+	});
+	grant->set_maximum(1 << 19);
+	printf("grant raised to %zu bytes (resized to %zu)\n", grant->get_size(), resized);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+/**
+ * Row::operator< comparing the columns one at a time, which the vectorized comparison must match bit for bit
+ */
+bool scalar_less(Row &a, Row &b) {
+	if (a.ovc != b.ovc)
+		return a.ovc < b.ovc;
+	for (uint32_t i = ARITY - (a.ovc >> 32) + 1; i < ARITY; i++) {
+		if (a.get_value(i) < b.get_value(i)) {
+			b.ovc = (ARITY-i) * OFFSET_MULTIPLIER + b.get_value(i);
+			return true;
+		} else if (a.get_value(i) > b.get_value(i)) {
+			a.ovc = (ARITY-i) * OFFSET_MULTIPLIER + a.get_value(i);
+			return false;
+		}
+	}
+	a.ovc = 0;
+	return false;
+}
+
+/**
+ * Compare records coded relative to a common smaller record, with few distinct values so that the codes often tie
+ */
+void test_row_compare() {
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for comparing records with vector instructions (num_pairs=1000000) *****\n");
+	size_t ties = 0;
+	size_t mismatches = 0;
+	for (size_t i=0; i<1000000; i++) {
+		// Few distinct key words, so that rows tie on their first words
+		auto small_word = [] { return (uint32_t) (rand() % 4); };
+		Row rows[3];
+		for (auto &row: rows)
+			row = Row::generate_random(small_word);
+		std::sort(rows, rows + 3, [](const Row &a, const Row &b) { return a.key_less(b); });
+		Row &base = rows[rand() % 2];
+		Row a = rows[1];
+		Row b = rows[2];
+		if (rand() % 2)
+			std::swap(a, b);
+		a.code_relative_to(base);
+		b.code_relative_to(base);
+		ties += a.ovc == b.ovc;
+		Row scalar_a = a;
+		Row scalar_b = b;
+		bool expected = scalar_less(scalar_a, scalar_b);
+		if ((a < b) != expected || a.ovc != scalar_a.ovc || b.ovc != scalar_b.ovc)
+			mismatches++;
+	}
+	printf("%zu ties, %zu mismatches\n", ties, mismatches);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+/**
+ * Records of a schema with mixed column types, coded relative to a common smaller record, must order like the tuples
+ * of their column values, and the code of the loser must be the one it gets relative to the winner
+ */
+void test_mixed_schema() {
+	typedef BasicRow<Schema<uint8_t, int64_t, double, uint16_t>> MixedRow;
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for a schema of mixed column types (num_pairs=1000000) *****\n");
+	size_t mismatches = 0;
+	for (size_t i=0; i<1000000; i++) {
+		std::tuple<uint8_t, int64_t, double, uint16_t> columns[3];
+		MixedRow rows[3];
+		for (size_t r=0; r<3; r++) {
+			// Few distinct values, some of them spanning both words of a 64-bit column
+			columns[r] = std::make_tuple(rand() % 3, (int64_t) (rand() % 5 - 2) << (rand() % 2 * 40),
+					(rand() % 5 - 2) * (rand() % 2? 0.25: 1e10), rand() % 3);
+			rows[r] = std::make_from_tuple<MixedRow>(columns[r]);
+			auto decoded = std::make_tuple(rows[r].get_column<0>(), rows[r].get_column<1>(), rows[r].get_column<2>(),
+					rows[r].get_column<3>());
+			if (decoded != columns[r])
+				mismatches++;
+		}
+		size_t base = std::min_element(columns, columns + 3) - columns;
+		MixedRow &a = rows[(base + 1) % 3];
+		MixedRow &b = rows[(base + 2) % 3];
+		auto &a_columns = columns[(base + 1) % 3];
+		auto &b_columns = columns[(base + 2) % 3];
+		if (a.key_less(b) != (a_columns < b_columns))
+			mismatches++;
+		a.code_relative_to(rows[base]);
+		b.code_relative_to(rows[base]);
+		bool a_wins = a < b;
+		if (a_wins != (a_columns < b_columns))
+			mismatches++;
+		MixedRow loser = a_wins? b: a;
+		loser.code_relative_to(a_wins? a: b);
+		if (loser.ovc != (a_wins? b: a).ovc)
+			mismatches++;
+	}
+	printf("%zu mismatches\n", mismatches);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+}
+
+// Column values of a row as a tuple
+template<typename RowType, size_t... Columns>
+auto get_columns(const RowType &row, std::index_sequence<Columns...>) {
+	return std::make_tuple(row.template get_column<Columns>()...);
+}
+
+/**
+ * Sort rows of `RowSchema` end to end, in memory and spilled, with each run sort, with replacement selection and on
+ * several threads. The output must be the input in the order of the column tuples, with every code relative to the
+ * previous row
+ */
+template<typename RowSchema, typename MakeColumns>
+void test_schema_sort(const char *schema_name, MakeColumns make_columns) {
+	typedef BasicRow<RowSchema> RowType;
+	typedef decltype(make_columns()) Columns;
+	const size_t num_rows = 100000;
+	std::vector<Columns> columns;
+	for (size_t i=0; i<num_rows; i++)
+		columns.push_back(make_columns());
+	std::vector<Columns> expected = columns;
+	std::sort(expected.begin(), expected.end());
+	struct Case {
+		const char *description;
+		size_t memory_budget;
+		RunSort run_sort;
+		bool replacement_selection;
+		size_t threads;
+		bool pax_runs;
+	};
+	for (auto &test_case: {Case {"in memory", 1ull << 30, RunSort::RADIX, false, 1, false},
+			Case {"spilled", 1ull << 20, RunSort::RADIX, false, 1, false},
+			Case {"spilled, block tournament run sort", 1ull << 20, RunSort::BLOCK_TOURNAMENT, false, 1, false},
+			Case {"spilled, tournament run sort", 1ull << 20, RunSort::TOURNAMENT, false, 1, false},
+			Case {"spilled, replacement selection", 1ull << 20, RunSort::RADIX, true, 1, false},
+			Case {"spilled, PAX runs", 1ull << 20, RunSort::RADIX, false, 1, true},
+			Case {"4 threads", 1ull << 30, RunSort::RADIX, false, 4, false}}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		printf("\n***** Running test for sorting the schema %s (num_rows=%zu, key words=%zu, row size=%zuB, %s) *****\n",
+				schema_name, num_rows, (size_t) RowType::KEY_WORDS, sizeof(RowType), test_case.description);
+		SorterConfig config = test_config(test_case.memory_budget);
+		config.run_sort = test_case.run_sort;
+		config.replacement_selection = test_case.replacement_selection;
+		config.run_threads = test_case.threads;
+		config.merge_threads = test_case.threads;
+		config.pax_runs = test_case.pax_runs;
+		BasicSorter<RowSchema> sorter {config};
+		for (auto &row_columns: columns) {
+			RowType row = std::make_from_tuple<RowType>(row_columns);
+			sorter.add_record(&row);
+		}
+		sorter.sort_contents();
+		size_t mismatches = 0;
+		RowType prev;
+		for (size_t i=0; i<num_rows; i++) {
+			RowType &row = sorter.get_next_record();
+			RowType coded = row;
+			if (i > 0)
+				coded.code_relative_to(prev);
+			else
+				coded.reset_ovc();
+			if (get_columns(row, std::make_index_sequence<RowSchema::COLUMNS>()) != expected[i] || coded.ovc != row.ovc)
+				mismatches++;
+			prev = row;
+		}
+		bool end_reached = sorter.get_next_record().is_inf();
+		printf("%zu rows, %zu mismatches, end %s\n", num_rows, mismatches, end_reached? "reached": "missing");
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+
+	// The calibration benchmark sorts rows of this schema, so the run size it picks is a multiple of the row size
+	auto start = std::chrono::high_resolution_clock::now();
+	printf("\n***** Running test for calibrating a sorter of the schema %s (row size=%zuB) *****\n",
+			schema_name, sizeof(RowType));
+	SorterConfig config = test_config();
+	config.run_size = 0;
+	config.fan_in = 0;
+	BasicSorter<RowSchema> sorter {config};
+	size_t run_size = sorter.get_config().run_size;
+	printf("%s, run size in whole rows: %s\n", sorter.get_config().to_string().c_str(),
+			YesNo(run_size > 0 && run_size % sizeof(RowType) == 0));
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+	std::cout << "Took: " << duration.count()/1000.0f << " ms (including calibration)\n";
+}
+
+/**
+ * Sort schemas other than the one the sorter is compiled for: a key of 5 words, wider than the integer keys of the
+ * block sort, a key of 4 words, which leaves no storage word for a row id, and narrow columns packed into 2 words.
+ * Few distinct values, some of them spanning both words of a 64-bit column, so that rows tie on their first words
+ */
+void test_other_schemas() {
+	typedef Schema<uint8_t, uint16_t, uint8_t, int32_t> NarrowSchema;
+	printf("\nSchema (uint8, uint16, uint8, int32): %zu key words, %zu columns in the first\n",
+			(size_t) NarrowSchema::KEY_WORDS, (size_t) NarrowSchema::PREFIX_COLUMNS);
+	test_schema_sort<NarrowSchema>("(uint8, uint16, uint8, int32)", [] {
+		return std::make_tuple((uint8_t) (rand() % 3), (uint16_t) (rand() % 3 * 30000), (uint8_t) (rand() % 256),
+				(int32_t) (rand() % 2001 - 1000));
+	});
+	test_schema_sort<Schema<uint8_t, int64_t, double, uint16_t>>("(uint8, int64, double, uint16)", [] {
+		return std::make_tuple((uint8_t) (rand() % 3), (int64_t) (rand() % 5 - 2) << (rand() % 2 * 40),
+				(rand() % 5 - 2) * (rand() % 2? 0.25: 1e10), (uint16_t) (rand() % 1000));
+	});
+	test_schema_sort<Schema<uint64_t, int64_t>>("(uint64, int64)", [] {
+		return std::make_tuple((uint64_t) (rand() % 7) << (rand() % 2 * 40),
+				(int64_t) (rand() % 100000 - 50000) << (rand() % 2 * 20));
+	});
+}
+
+/**
+ * Sort URL-like strings that mostly share their first words, in memory and with a budget that forces spilling. The
+ * output must match std::sort, and every code must be the one relative to the previous string
+ */
+void test_string_sort() {
+	const size_t num_rows = 200000;
+	std::vector<std::string> strings;
+	const char *hosts[] = {"https://a.example.com/", "https://b.example.com/users/", "http://c.example.org/"};
+	for (size_t i=0; i<num_rows; i++) {
+		std::string string = hosts[rand() % 3] + std::to_string(rand() % 50000);
+		string.append(rand() % 40, 'a' + rand() % 3);
+		strings.push_back(std::move(string));
+	}
+	std::vector<std::string> expected = strings;
+	std::sort(expected.begin(), expected.end());
+	for (size_t memory_budget: {1ull << 30, 1ull << 20}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		// All the runs fit in memory and in a single merge, or they are spilled and merged 4 at a time
+		size_t fan_in = (memory_budget > (1 << 20))? 256: 4;
+		printf("\n***** Running test for sorting strings (num_rows=%zu, memory=%zuKB, fan-in=%zu) *****\n", num_rows,
+				memory_budget >> 10, fan_in);
+		SorterConfig config = test_config(memory_budget);
+		config.fan_in = fan_in;
+		MemoryBroker broker {memory_budget};
+		config.memory_broker = &broker;
+		StringSorter sorter {config};
+		for (auto &string: strings)
+			sorter.add_record(string.data(), string.size());
+		sorter.sort_contents();
+		size_t num_output = 0;
+		size_t mismatches = 0;
+		while (StringRow *row = sorter.get_next_record()) {
+			StringRow coded {row->get_string(), row->get_length()};
+			if (num_output > 0)
+				coded.code_relative_to(StringRow(expected[num_output-1].data(), expected[num_output-1].size()));
+			if (num_output >= num_rows || row->to_string() != expected[num_output] || coded.ovc != row->ovc)
+				mismatches++;
+			num_output++;
+		}
+		printf("%zu rows, %zu spilled runs, %zu mismatches\n", num_output, sorter.get_num_spilled_runs(), mismatches);
+		printf("%s\n", broker.to_string().c_str());
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+}
+
+/**
+ * Sorts records with 256-byte payloads by their keys and row ids alone, with the payloads in memory and spilled, and
+ * checks that every record comes back in order with its own payload
+ */
+void test_payload_sort() {
+	const size_t num_rows = 200000;
+	struct Payload {
+		uint32_t key[ARITY];
+		uint32_t index;
+		char filler[256 - 4 * (ARITY + 1)];
+	};
+	// Payloads in memory, spilled alongside the runs, spilled while replacement selection writes its runs to disk, and
+	// spilled with runs in PAX pages, which keep the row ids
+	for (auto [memory_budget, replacement_selection, pax_runs]: {std::make_tuple(1ull << 30, false, false),
+			std::make_tuple(1ull << 22, false, false), std::make_tuple(1ull << 22, true, false),
+			std::make_tuple(1ull << 22, false, true)}) {
+		auto start = std::chrono::high_resolution_clock::now();
+		printf("\n***** Running test for sorting keys apart from payloads "
+				"(num_rows=%zu, payload=%zuB, memory=%zuKB%s%s) *****\n",
+				num_rows, sizeof(Payload), (size_t) memory_budget >> 10,
+				replacement_selection? ", replacement selection": "", pax_runs? ", PAX runs": "");
+		SorterConfig config = test_config(memory_budget);
+		config.payload_size = sizeof(Payload);
+		config.replacement_selection = replacement_selection;
+		config.pax_runs = pax_runs;
+		Sorter sorter {config};
+		Payload payload;
+		for (size_t i=0; i<num_rows; i++) {
+			std::unique_ptr<Row> row {Row::generate_random()};
+			for (uint32_t j=0; j<ARITY; j++)
+				payload.key[j] = row->get_value(j);
+			payload.index = i;
+			memset(payload.filler, (char) i, sizeof(payload.filler));
+			sorter.add_record(row.get(), &payload);
+		}
+		sorter.sort_contents();
+		std::vector<bool> seen(num_rows);
+		Row prev = Row::inf();
+		// There is no payload before the first record
+		size_t mismatches = (sorter.get_payload() != nullptr);
+		for (size_t i=0; i<num_rows; i++) {
+			Row &row = sorter.get_next_record();
+			const Payload *gathered = static_cast<const Payload*>(sorter.get_payload());
+			bool matches = gathered->index < num_rows && !seen[gathered->index]
+					&& gathered->filler[sizeof(gathered->filler) - 1] == (char) gathered->index;
+			for (uint32_t j=0; j<ARITY; j++)
+				matches &= gathered->key[j] == row.get_value(j);
+			if (!matches || (i > 0 && row.key_less(prev)))
+				mismatches++;
+			if (gathered->index < num_rows)
+				seen[gathered->index] = true;
+			prev = row;
+		}
+		bool end_reached = sorter.get_next_record().is_inf() && sorter.get_payload() == nullptr;
+		printf("%zu rows, %zu mismatches, end %s\n", num_rows, mismatches, end_reached? "reached": "missing");
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start);
+		std::cout << "Took: " << duration.count()/1000.0f << " ms\n";
+	}
+}
 
 int main (int argc, char * argv [])
 {
@@ -97,6 +682,26 @@ int main (int argc, char * argv [])
 	test_internal_merge_sort2();
 	test_external_merge_sort1();
 	test_external_merge_sort2();
+	test_spilling_merge_sort();
+	test_pax_runs();
+	test_calibrated_config();
+	test_replacement_selection();
+	test_tournament_run_sort();
+	test_block_tournament_run_sort();
+	test_parallel_run_generation();
+	test_parallel_merge();
+	test_parallel_final_merge();
+	test_streaming_merge();
+	test_cost_based_plan();
+	test_streaming_stores();
+	test_prefetch_distance();
+	test_memory_resize();
+	test_memory_broker();
+	test_row_compare();
+	test_mixed_schema();
+	test_other_schemas();
+	test_string_sort();
+	test_payload_sort();
 
 	printf("\nCompleted tests\n");
 	return 0;
@@ -0,0 +1,84 @@
+#include "ThreadPool.h"
+#include <pthread.h>
+#include <sched.h>
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_threads) {
+    std::vector<int> cpus;
+    if (pin_threads) {
+        cpus = allowed_cpus();
+    }
+    for (size_t i=0; i<num_threads; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+        if (!cpus.empty()) {
+            pin_thread(workers.back(), cpus[i % cpus.size()]);
+        }
+    }
+}
+
+std::vector<int> ThreadPool::allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+void ThreadPool::pin_thread(std::thread &thread, int cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set), &cpu_set);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    task_available.notify_all();
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        unfinished++;
+    }
+    task_available.notify_one();
+}
+
+void ThreadPool::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return unfinished == 0; });
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                // Stopping and all the tasks are done
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        // Release whatever the task captured before it is reported as finished
+        task = nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--unfinished == 0) {
+            idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Class representing a fixed-size pool of worker threads that execute tasks in FIFO order
+ */
+class ThreadPool {
+public:
+    // If `pin_threads` is set, worker i is bound to the i-th CPU that the process may run on
+    ThreadPool(size_t num_threads, bool pin_threads = false);
+
+    // Runs all the queued tasks before joining the workers
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    // Block until all the submitted tasks have finished
+    void wait_idle();
+
+    // CPUs that the process is allowed to run on
+    static std::vector<int> allowed_cpus();
+
+    // Bind a thread to a single CPU. Pinning is only a hint for locality, so failures are ignored
+    static void pin_thread(std::thread &thread, int cpu);
+
+private:
+    std::vector<std::thread> workers;
+
+    std::deque<std::function<void()>> tasks;
+
+    std::mutex mutex;
+
+    std::condition_variable task_available;
+
+    std::condition_variable idle;
+
+    // Tasks that have been submitted but have not finished yet
+    size_t unfinished {0};
+
+    bool stopping {false};
+
+    void worker_loop();
+};
@@ -1,79 +1,205 @@
 #pragma once
 #include "Record.h"
+#include <array>
+#include <type_traits>
 #include <vector>
 #include <iostream>
 #include <memory>
 #include <boost/align/aligned_allocator.hpp>
 
 /**
- * Struct representing a node in a tournament tree
+ * Struct representing a node in the tournament tree of replacement selection, which holds whole rows
  */
-struct TournamentTreeNode {
-    Row record;
+template<typename RowType>
+struct BasicTournamentTreeNode {
+    RowType record;
 
     uint32_t index; // run identifier
 
-    TournamentTreeNode(Row record, uint32_t index): record(std::move(record)), index(index) {}
+    BasicTournamentTreeNode(RowType record, uint32_t index): record(std::move(record)), index(index) {}
 
-    TournamentTreeNode() = default;
+    BasicTournamentTreeNode() = default;
+};
+
+typedef BasicTournamentTreeNode<Row> TournamentTreeNode;
+
+/**
+ * Struct representing a node of the tournament tree that merges sorted runs. Only the offset-value code and the run of
+ * the loser are kept, so that four nodes fit in a cache line. The row itself is the current row of its run
+ */
+struct MergeTreeNode {
+    OVC ovc;
+
+    uint32_t index; // run identifier
+};
+
+// Type of the rows that a reader returns: its RowType if it declares one, Row otherwise
+template<typename ReaderType, typename = void>
+struct ReaderRow {
+    typedef Row type;
+};
+
+template<typename ReaderType>
+struct ReaderRow<ReaderType, std::void_t<typename ReaderType::RowType>> {
+    typedef typename ReaderType::RowType type;
 };
 
 /**
  * Class representing a tree-of-losers priority queue. Given a set of inputs, this class is responsible for building 
  * the tournament tree and performing merge sort via leaf-to-root passes. We templatize this class since we use the same
- * implementation for both external and internal sort
+ * implementation for both external and internal sort. The nodes hold offset-value codes relative to the last winner,
+ * and the rows are only read through the current row of each run when two codes tie. A run that is exhausted is
+ * coded as larger than any row.
+ *
+ * Rows of any type with the offset-value coding interface of Row (KEY_WORDS and break_tie()) can be merged.
+ *
+ * If `FanIn` is 0, the tree is sized at runtime for any number of inputs. Otherwise it merges at most `FanIn` inputs
+ * with its nodes held inline, and every leaf-to-root pass has the same number of levels, so the pass is unrolled and
+ * its winners are selected with conditional moves. Use with_tournament_tree() to pick the smallest such tree
  */
-template<typename ReaderType>
+template<typename ReaderType, size_t FanIn = 0>
 class TournamentTree {
+    static_assert((FanIn & (FanIn - 1)) == 0, "The fan-in of a tournament tree must be a power of 2");
+
+    typedef typename ReaderRow<ReaderType>::type RowType;
+
 public:
-    TournamentTree(std::vector<std::shared_ptr<ReaderType>> &inputs): inputs(inputs) {
+    /**
+     * If `prefetch_distance` is set, every input is prefetched that many cache lines ahead of its read position, and
+     * the nodes on the path of the winner are prefetched after every pass, so that they are in cache when the next
+     * pop() replays that path. This pays off once the tree no longer fits in L1
+     */
+    TournamentTree(std::vector<std::shared_ptr<ReaderType>> &inputs, size_t prefetch_distance = 0)
+        : inputs(inputs), prefetch_path(prefetch_distance != 0), prefetch_bytes(prefetch_distance * 64) {
         initialize();
     }
     
-    Row pop() {
-        auto prev_top_node = std::move(top_node);
-        leaf_to_root_pass(prev_top_node.index);
-        return prev_top_node.record;
+    /**
+     * Return the next row in sorted order with its offset-value code relative to the previous one, or nullptr once
+     * all the inputs are exhausted. The row stays valid until the next call
+     */
+    RowType* pop() {
+        if (winner_popped) {
+            // Reading the next row of a run may overwrite the block that holds its current row, so the run of the
+            // last winner is only advanced once that row has been used
+            leaf_to_root_pass(top_node.index);
+        }
+        if (top_node.ovc == INF_OVC) {
+            winner_popped = false;
+            return nullptr;
+        }
+        RowType *winner = current_rows[top_node.index];
+        winner->ovc = top_node.ovc;
+        winner_popped = true;
+        return winner;
     }
 
 private:
+    // Code of an exhausted run. Offset-value codes of rows are below 2^34
+    static const OVC INF_OVC = UINT64_MAX;
+
     // Store the top node separately
-    TournamentTreeNode top_node;
+    MergeTreeNode top_node;
+
+    template<typename T>
+    using Storage = typename std::conditional<FanIn == 0, std::vector<T>, std::array<T, FanIn>>::type;
 
     // Array to hold tournament tree for external merge sort
-    // std::vector<TournamentTreeNode, boost::alignment::aligned_allocator<TournamentTreeNode, 64>> tournament_tree;
-    std::vector<TournamentTreeNode> tournament_tree;
+    Storage<MergeTreeNode> tournament_tree;
 
     // Build the tournament tree from the inputs
     std::vector<std::shared_ptr<ReaderType>> inputs;
 
+    // Row at the head of every run, read from it by the last leaf-to-root pass of the run
+    Storage<RowType*> current_rows;
+
+    // Span of rows of every run that has been read with read_batch() but not yet entered into the tree
+    Storage<RowType*> cursors;
+
+    Storage<RowType*> batch_ends;
+
+    /**
+     * Position of the leaf of the first run. Node i has the children 2i+1 and 2i+2. A fixed fan-in uses the complete
+     * binary tree with FanIn-1 internal nodes, so that all the leaves are at the same depth
+     */
+    inline size_t leaf_base() {
+        if constexpr (FanIn == 0) {
+            return tournament_tree.size();
+        } else {
+            return FanIn - 1;
+        }
+    }
+
+    // Levels of a leaf-to-root pass if the fan-in is fixed
+    static constexpr size_t levels() {
+        size_t levels = 0;
+        while ((size_t(1) << levels) < FanIn) {
+            levels++;
+        }
+        return levels;
+    }
+
+    bool prefetch_path;
+
+    size_t prefetch_bytes;
+
+    // Set if the top node has been returned by pop() but its run has not been advanced yet
+    bool winner_popped {false};
+
     void initialize() {
-        size_t input_size = inputs.size();
-        uint32_t closest_power_of_2 = 1;
-        while (closest_power_of_2 < input_size) {
-            closest_power_of_2 *= 2;
+        if constexpr (FanIn == 0) {
+            size_t input_size = inputs.size();
+            uint32_t closest_power_of_2 = 1;
+            while (closest_power_of_2 < input_size) {
+                closest_power_of_2 *= 2;
+            }
+            /** 
+             * For simplicity, we only resize the tournament tree to the required number of internal nodes
+             * In case of leaf nodes, we directly read from the corresponding input runs
+            */
+            tournament_tree.resize(closest_power_of_2);
+            current_rows.resize(input_size);
+            cursors.resize(input_size, nullptr);
+            batch_ends.resize(input_size, nullptr);
+        } else {
+            cursors.fill(nullptr);
+            batch_ends.fill(nullptr);
+        }
+        top_node = init_helper(0);
+        if (prefetch_path) {
+            prefetch_winner_path();
         }
-        /** 
-         * For simplicity, we only resize the tournament tree to the required number of internal nodes
-         * In case of leaf nodes, we directly read from the corresponding input runs
-        */
-        tournament_tree.resize(closest_power_of_2);
-        auto res = init_helper(0);
-        top_node.index = res.second;
-        top_node.record = std::move(res.first);
+    }
+
+    // Move the head of a run to its next row, and return its node
+    inline MergeTreeNode read_run(uint32_t run_idx) {
+        RowType *&cursor = cursors[run_idx];
+        if (cursor == batch_ends[run_idx]) {
+            // The only call into the input, once per span
+            inputs[run_idx]->read_batch(cursor, batch_ends[run_idx]);
+            if (cursor == batch_ends[run_idx]) {
+                return MergeTreeNode {INF_OVC, run_idx};
+            }
+        }
+        if (prefetch_bytes != 0 && (char*) cursor + prefetch_bytes < (char*) batch_ends[run_idx]) {
+            // Dozens of interleaved input streams are more than the hardware prefetcher tracks
+            __builtin_prefetch((char*) cursor + prefetch_bytes);
+        }
+        current_rows[run_idx] = cursor;
+        return MergeTreeNode {(cursor++)->ovc, run_idx};
     }
 
     // Recursive helper method for building the initial tournament tree
-    std::pair<Row, uint32_t> init_helper(uint32_t i) {
-        size_t size = tournament_tree.size();
+    MergeTreeNode init_helper(uint32_t i) {
+        size_t size = leaf_base();
         
         if (i >= size) {
             // Called from a leaf node, return a record from the corresponding sorted run
             uint32_t run_idx = i-size;
             if (run_idx < inputs.size()) {
-                return std::make_pair<>(inputs[run_idx]->read_next(), run_idx);
+                return read_run(run_idx);
             } else {
-                return std::make_pair<>(Row::inf(), run_idx);
+                return MergeTreeNode {INF_OVC, run_idx};
             }
         } else {
             /**
@@ -86,35 +212,83 @@ private:
             uint32_t i2 = 2*i + 2;
             auto val1 = init_helper(i1);
             auto val2 = init_helper(i2);
-            auto compare_res = (val1.first < val2.first);   // Compare the data records
-            if (compare_res) {
-                tournament_tree[i].record = std::move(val2.first);
-                tournament_tree[i].index = val2.second;
+            if (less(val1, val2)) {
+                tournament_tree[i] = val2;
                 return val1;
             } else {
-                tournament_tree[i].record = std::move(val1.first);
-                tournament_tree[i].index = val1.second;
+                tournament_tree[i] = val1;
                 return val2;
             }
         }
     }
 
+    /**
+     * Whether node `a` wins against node `b`. Both codes are relative to the same row. If they tie, the columns after
+     * the offset are compared and the code of the loser is made relative to the winner, as in Row::operator<
+     */
+    inline bool less(MergeTreeNode &a, MergeTreeNode &b) {
+        if (a.ovc != b.ovc) {
+            return a.ovc < b.ovc;
+        }
+        if (a.ovc == INF_OVC) {
+            return false;
+        }
+        const RowType &row_a = *current_rows[a.index];
+        const RowType &row_b = *current_rows[b.index];
+        return RowType::break_tie(row_a, a.ovc, row_b, b.ovc, RowType::KEY_WORDS - (a.ovc >> 32) + 1);
+    }
+
+    // Prefetch the nodes that the leaf-to-root pass of the current winner will visit
+    void prefetch_winner_path() {
+        uint32_t idx = (leaf_base() + top_node.index - 1)/2;
+        while (true) {
+            __builtin_prefetch(&tournament_tree[idx]);
+            if (!idx) {
+                break;
+            }
+            idx = (idx-1)/2;
+        }
+    }
+
     // Performs leaf-to-root pass in tournament tree
     void leaf_to_root_pass(uint32_t run_idx) {
         /**
          * Leaf node corresponding to index: (n + run_idx), where n -> size of tournament tree
          * For a leaf node i, its parent will be (i-1)/2
          */
-        uint32_t idx = (tournament_tree.size() + run_idx - 1)/2;
-        auto new_record = inputs[run_idx]->read_next();
-        TournamentTreeNode cur_node {new_record, run_idx};
+        uint32_t idx = (leaf_base() + run_idx - 1)/2;
+        MergeTreeNode cur_node = read_run(run_idx);
+        if constexpr (FanIn != 0) {
+            for (size_t level = 0; level < levels(); level++) {
+                MergeTreeNode &node = tournament_tree[idx];
+                bool node_wins = node.ovc < cur_node.ovc;
+                if (__builtin_expect(node.ovc == cur_node.ovc, 0)) {
+                    // Only ties read the rows
+                    node_wins = less(node, cur_node);
+                }
+                // Select with masks rather than branches, which mispredict on every other level
+                uint64_t mask = -(uint64_t) node_wins;
+                OVC winner_ovc = (node.ovc & mask) | (cur_node.ovc & ~mask);
+                OVC loser_ovc = (cur_node.ovc & mask) | (node.ovc & ~mask);
+                uint32_t winner_index = (node.index & mask) | (cur_node.index & ~mask);
+                uint32_t loser_index = (cur_node.index & mask) | (node.index & ~mask);
+                node = MergeTreeNode {loser_ovc, loser_index};
+                cur_node = MergeTreeNode {winner_ovc, winner_index};
+                idx = (idx-1)/2;
+            }
+            top_node = cur_node;
+            if (prefetch_path) {
+                prefetch_winner_path();
+            }
+            return;
+        }
         while (true) {
             /**
              * Compare cur_node and tournament_tree[idx]
              * Store the loser at position idx
              * Propagate the winner up the tree
              */
-            if (tournament_tree[idx].record < cur_node.record) {
+            if (less(tournament_tree[idx], cur_node)) {
                 std::swap(tournament_tree[idx], cur_node);
             }
             if (!idx) {
@@ -122,6 +296,197 @@ private:
             }
             idx = (idx-1)/2;
         }
+        top_node = cur_node;
+        if (prefetch_path) {
+            prefetch_winner_path();
+        }
+    }
+};
+
+/**
+ * Call `merge(tree)` with the tournament tree over the inputs that has the smallest fan-in fixed at compile time, or
+ * with a tree sized at runtime if there are more than 256 inputs
+ */
+template<typename ReaderType, typename Merge>
+void with_tournament_tree(std::vector<std::shared_ptr<ReaderType>> &inputs, size_t prefetch_distance, Merge &&merge) {
+    size_t fan_in = inputs.size();
+    if (fan_in <= 2) {
+        TournamentTree<ReaderType, 2> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 4) {
+        TournamentTree<ReaderType, 4> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 8) {
+        TournamentTree<ReaderType, 8> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 16) {
+        TournamentTree<ReaderType, 16> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 32) {
+        TournamentTree<ReaderType, 32> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 64) {
+        TournamentTree<ReaderType, 64> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 128) {
+        TournamentTree<ReaderType, 128> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else if (fan_in <= 256) {
+        TournamentTree<ReaderType, 256> tree {inputs, prefetch_distance};
+        merge(tree);
+    } else {
+        TournamentTree<ReaderType> tree {inputs, prefetch_distance};
+        merge(tree);
+    }
+}
+
+/**
+ * Class representing a tree-of-losers priority queue for run generation by replacement selection. Unlike
+ * TournamentTree, the tree is not rebuilt for every run. It stays resident across the whole input and every row that
+ * is output is replaced by the next input row. An input row that is smaller than the row it replaces can't be part of
+ * the current run, so it is tagged for the next run. The run number is treated as a leading key column: a row of the
+ * next run is coded as differing from the last output row at that column, so the usual offset-value code comparisons
+ * order the rows by (run, key)
+ */
+template<typename RowType>
+class BasicReplacementSelectionTree {
+    typedef BasicTournamentTreeNode<RowType> TournamentTreeNode;
+
+public:
+    // The number of rows held by the tree is `capacity` rounded down to a power of 2
+    BasicReplacementSelectionTree(size_t capacity) {
+        num_leaves = 2;
+        while (num_leaves * 2 <= capacity) {
+            num_leaves *= 2;
+        }
+        fill_rows.reserve(num_leaves);
+    }
+
+    // Number of rows held by the tree
+    inline size_t get_capacity() {
+        return num_leaves;
+    }
+
+    inline bool is_initialized() {
+        return fill_rows.empty() && !tournament_tree.empty();
+    }
+
+    /**
+     * Add one of the first rows of the input. The tree is built once `capacity` rows have been added. Returns false
+     * if the tree is already built
+     */
+    bool fill(const RowType &row) {
+        if (is_initialized()) {
+            return false;
+        }
+        fill_rows.push_back(row);
+        // Code relative to the start of the first run
+        fill_rows.back().reset_ovc();
+        if (fill_rows.size() == num_leaves) {
+            initialize();
+        }
+        return true;
+    }
+
+    /**
+     * Build the tree from the rows added so far. Must be called before reading from the tree if the input is smaller
+     * than the capacity
+     */
+    void initialize() {
+        if (is_initialized()) {
+            return;
+        }
+        while (fill_rows.size() < num_leaves) {
+            fill_rows.push_back(end_row());
+        }
+        tournament_tree.resize(num_leaves);
+        // Leaf i is node num_leaves+i, the parent of node i is i/2 and node 1 is the root
+        std::vector<uint32_t> winners(2 * num_leaves);
+        for (uint32_t i=0; i<num_leaves; i++) {
+            winners[num_leaves + i] = i;
+        }
+        for (uint32_t node=num_leaves-1; node>0; node--) {
+            uint32_t left = winners[2*node];
+            uint32_t right = winners[2*node + 1];
+            if (fill_rows[left] < fill_rows[right]) {
+                tournament_tree[node] = TournamentTreeNode(fill_rows[right], right);
+                winners[node] = left;
+            } else {
+                tournament_tree[node] = TournamentTreeNode(fill_rows[left], left);
+                winners[node] = right;
+            }
+        }
+        top_node = TournamentTreeNode(fill_rows[winners[1]], winners[1]);
+        std::vector<RowType>().swap(fill_rows);
+    }
+
+    // The next row in sorted order. Its offset-value code is relative to the previous output row
+    inline RowType& top() {
+        return top_node.record;
+    }
+
+    // Whether the top row is the first row of a new run (other than the first run)
+    inline bool top_starts_run() {
+        return top_node.record.ovc >= NEXT_RUN_OVC && !empty();
+    }
+
+    // Whether all the rows have been output
+    inline bool empty() {
+        return top_node.record.ovc == END_OVC;
+    }
+
+    // Output the top row and replace it with the next input row
+    void replace_top(RowType row) {
+        if (!row.code_relative_to(top_node.record)) {
+            // Smaller than the row it replaces. Tag it for the next run
+            row.ovc = NEXT_RUN_OVC + current_run + 1;
+        }
+        leaf_to_root_pass(std::move(row));
+    }
+
+    // Output the top row at the end of the input
+    void pop_top() {
+        leaf_to_root_pass(end_row());
+    }
+
+private:
+    // Code of a row that differs from the previous output row in the run number
+    static const OVC NEXT_RUN_OVC = (RowType::KEY_WORDS+1) * OFFSET_MULTIPLIER;
+
+    // Code of the rows that fill the leaves at the end of the input. Larger than the code of any row
+    static const OVC END_OVC = UINT64_MAX;
+
+    uint32_t num_leaves;
+
+    // Internal nodes holding the losers. Node 0 is unused
+    std::vector<TournamentTreeNode> tournament_tree;
+
+    TournamentTreeNode top_node;
+
+    // Rows collected before the tree is built
+    std::vector<RowType> fill_rows;
+
+    // Run of the top row
+    uint32_t current_run {0};
+
+    static RowType end_row() {
+        RowType row = RowType::inf();
+        row.ovc = END_OVC;
+        return row;
+    }
+
+    void leaf_to_root_pass(RowType &&row) {
+        TournamentTreeNode cur_node {std::move(row), top_node.index};
+        for (uint32_t idx = (num_leaves + cur_node.index)/2; idx > 0; idx /= 2) {
+            if (tournament_tree[idx].record < cur_node.record) {
+                std::swap(tournament_tree[idx], cur_node);
+            }
+        }
         top_node = std::move(cur_node);
+        if (top_starts_run()) {
+            current_run++;
+        }
     }
-};
\ No newline at end of file
+};
+
+typedef BasicReplacementSelectionTree<Row> ReplacementSelectionTree;